@@ -0,0 +1,37 @@
+#!/usr/bin/env lua
+
+-- Measures the decoding cost per message of query() for the
+-- default tables, a field list and lazy message objects.
+-- usage: bench.lua [rounds]
+
+local nl = require"netlink"
+
+local rounds = tonumber(arg[1]) or 200
+
+local function bench(name, groups, opts, read)
+  local s = nl.socket(nil, opts)
+  local n = 0
+  local start = os.clock()
+
+  for _ = 1, rounds do
+    for _, entry in ipairs(s:query(groups)) do
+      read(entry)
+      n = n + 1
+    end
+  end
+  local secs = os.clock() - start
+  print(string.format("%-10s %8d messages %8.3f s %8.2f us/message",
+                      name, n, secs, n > 0 and secs * 1e6 / n or 0))
+end
+
+local function two_fields(entry)
+  return entry.name, entry.running
+end
+
+local all = { link = true, ifaddr = true, route = true, neigh = true }
+local projected = { link = { "name", "running" }, ifaddr = true,
+                    route = true, neigh = true }
+
+bench("tables", all, nil, two_fields)
+bench("fields", projected, nil, two_fields)
+bench("lazy", all, { lazy = true }, two_fields)
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2021 Christian Hohnstaedt
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <libmnl/libmnl.h>
+#include <linux/filter.h>
+#include <linux/rtnetlink.h>
+
+#include "netlink.h"
+
+/* Classic BPF filter of the event socket, compiled from the socket
+ * option "filter". Unwanted events are dropped by the kernel before
+ * they are queued on the socket.
+ *
+ * Half words and words are loaded in network byte order, so the values
+ * of the host order netlink headers are compared by htons() and htonl().
+ * Jump offsets of conditional jumps have only 8 bits: Sets are limited
+ * to NL_FILTER_MAX entries and the group blocks are skipped by "ja".
+ */
+
+#define BPF_MAX_INSNS 1024
+#define BPF_ACCEPT 0xffffffff
+
+struct nlbpf {
+	struct sock_filter insn[BPF_MAX_INSNS];
+	unsigned int len;
+	lua_State *L;
+};
+
+void bpf_emit(struct nlbpf *p, uint16_t code, uint8_t jt, uint8_t jf,
+		uint32_t k)
+{
+	struct sock_filter insn = BPF_JUMP(code, k, jt, jf);
+
+	if (p->len >= BPF_MAX_INSNS)
+		luaL_error(p->L, "Event filter too large");
+	p->insn[p->len++] = insn;
+}
+
+/* Loads the value of "size" bytes at "offset" of the message */
+void bpf_load(struct nlbpf *p, int size, uint32_t offset)
+{
+	bpf_emit(p, BPF_LD | BPF_ABS | (size == 4 ? BPF_W :
+			size == 2 ? BPF_H : BPF_B), 0, 0, offset);
+}
+
+/* Loads the u32 payload of the attribute "type" following the family
+ * header of "hdrlen" bytes. Drops the message if it is missing.
+ */
+void bpf_load_attr(struct nlbpf *p, size_t hdrlen, int type)
+{
+	bpf_emit(p, BPF_LD | BPF_IMM, 0, 0, NLMSG_HDRLEN + MNL_ALIGN(hdrlen));
+	bpf_emit(p, BPF_LDX | BPF_IMM, 0, 0, type);
+	bpf_emit(p, BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_NLATTR);
+	bpf_emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0);
+	bpf_emit(p, BPF_RET | BPF_K, 0, 0, 0);
+	bpf_emit(p, BPF_MISC | BPF_TAX, 0, 0, 0);
+	bpf_emit(p, BPF_LD | BPF_W | BPF_IND, 0, 0, MNL_ATTR_HDRLEN);
+}
+
+/* Drops the message, if the loaded value of "size" bytes is not in "set" */
+void bpf_in_set(struct nlbpf *p, int size, const uint32_t *set, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		bpf_emit(p, BPF_JMP | BPF_JEQ | BPF_K, n - i, 0,
+			size == 4 ? htonl(set[i]) :
+			size == 2 ? htons(set[i]) : set[i]);
+	bpf_emit(p, BPF_RET | BPF_K, 0, 0, 0);
+}
+
+/* Drops the message, if none of the bits of the loaded half word is set */
+void bpf_any_bit(struct nlbpf *p, uint16_t bits)
+{
+	bpf_emit(p, BPF_JMP | BPF_JSET | BPF_K, 1, 0, htons(bits));
+	bpf_emit(p, BPF_RET | BPF_K, 0, 0, 0);
+}
+
+/* Reads the integer or array of integers "which" of the table at "idx" */
+static int filter_set(lua_State *L, int idx, const char *which,
+			uint32_t *set)
+{
+	lua_Integer i, n;
+
+	lua_getfield(L, idx, which);
+	if (lua_isnil(L, -1)) {
+		n = 0;
+	} else if (lua_isinteger(L, -1)) {
+		set[0] = lua_tointeger(L, -1);
+		n = 1;
+	} else {
+		luaL_checktype(L, -1, LUA_TTABLE);
+		n = luaL_len(L, -1);
+		if (n > NL_FILTER_MAX)
+			luaL_error(L, "Too many entries in filter '%s'", which);
+		for (i = 0; i < n; i++) {
+			lua_rawgeti(L, -1, i +1);
+			if (!lua_isinteger(L, -1))
+				luaL_error(L, "Filter '%s' must contain "
+						"integers", which);
+			set[i] = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+	return n;
+}
+
+/* Reads the array of event names like "newlink" into message types */
+static int filter_events(lua_State *L, int idx, uint32_t *set)
+{
+	const struct rtmgrp *rtmgrp;
+	lua_Integer i, n;
+
+	lua_getfield(L, idx, "events");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	luaL_checktype(L, -1, LUA_TTABLE);
+	n = luaL_len(L, -1);
+	if (n > NL_FILTER_MAX)
+		luaL_error(L, "Too many entries in filter 'events'");
+
+	for (i = 0; i < n; i++) {
+		const char *name;
+
+		lua_rawgeti(L, -1, i +1);
+		name = lua_tostring(L, -1);
+		if (!name)
+			luaL_error(L, "Filter 'events' must contain strings");
+		for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp; rtmgrp++) {
+			if (strlen(name) > 3 && !strcmp(name + 3, rtmgrp->name))
+				break;
+		}
+		if (rtmgrp == &__stop_rtmgrp ||
+		    (strncmp(name, "new", 3) && strncmp(name, "del", 3)))
+			luaL_error(L, "Unknown event '%s'", name);
+		set[i] = name[0] == 'n' ? rtmgrp->new : rtmgrp->del;
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return n;
+}
+
+static void filter_from_option(lua_State *L, int idx,
+			struct event_filter *f)
+{
+	memset(f, 0, sizeof *f);
+	f->nindex = filter_set(L, idx, "index", f->index);
+	f->ntable = filter_set(L, idx, "table", f->table);
+	f->ntypes = filter_events(L, idx, f->types);
+
+	lua_getfield(L, idx, "state");
+	if (!lua_isnil(L, -1))
+		f->state = neigh_state_bits(L, lua_gettop(L));
+	lua_pop(L, 1);
+}
+
+/* Appends the checks of every group with a "bpf" function. Messages
+ * of other groups or of groups without a matching check are accepted.
+ */
+static void bpf_groups(struct nlbpf *p, const struct event_filter *f)
+{
+	const struct rtmgrp *rtmgrp;
+
+	for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp; rtmgrp++) {
+		unsigned int start = p->len;
+
+		if (!rtmgrp->bpf)
+			continue;
+		bpf_load(p, 2, offsetof(struct nlmsghdr, nlmsg_type));
+		bpf_emit(p, BPF_JMP | BPF_JEQ | BPF_K, 2, 0, htons(rtmgrp->new));
+		bpf_emit(p, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, htons(rtmgrp->del));
+		bpf_emit(p, BPF_JMP | BPF_JA, 0, 0, 0);
+
+		rtmgrp->bpf(p, f);
+		if (p->len == start + 4) {
+			p->len = start;
+			continue;
+		}
+		bpf_emit(p, BPF_RET | BPF_K, 0, 0, BPF_ACCEPT);
+		p->insn[start + 3].k = p->len - (start + 4);
+	}
+}
+
+/* Compiles the filter table at "idx" and attaches it to the socket.
+ * Replies to requests of the socket itself are always accepted.
+ */
+void bpf_attach(lua_State *L, int idx, struct userdata *userdata)
+{
+	struct event_filter f;
+	struct sock_fprog fprog;
+	struct nlbpf *p;
+
+	filter_from_option(L, idx, &f);
+	p = lua_newuserdata(L, sizeof *p);
+	p->len = 0;
+	p->L = L;
+
+	bpf_load(p, 4, offsetof(struct nlmsghdr, nlmsg_pid));
+	bpf_emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 1,
+			htonl(mnl_socket_get_portid(userdata->nl)));
+	bpf_emit(p, BPF_RET | BPF_K, 0, 0, BPF_ACCEPT);
+
+	if (f.ntypes) {
+		bpf_load(p, 2, offsetof(struct nlmsghdr, nlmsg_type));
+		bpf_in_set(p, 2, f.types, f.ntypes);
+	}
+	bpf_groups(p, &f);
+	bpf_emit(p, BPF_RET | BPF_K, 0, 0, BPF_ACCEPT);
+
+	fprog.len = p->len;
+	fprog.filter = p->insn;
+	if (setsockopt(mnl_socket_get_fd(userdata->nl), SOL_SOCKET,
+			SO_ATTACH_FILTER, &fprog, sizeof fprog) < 0)
+		luaL_error(L, "setsockopt(SO_ATTACH_FILTER): %s",
+				strerror(errno));
+	lua_pop(L, 1);
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2021 Christian Hohnstaedt
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "netlink.h"
+
+#define CACHE_MIN_SIZE 64
+
+/* FNV-1a */
+static uint32_t cache_hash(const void *key, size_t keylen)
+{
+	const unsigned char *p = key;
+	uint32_t hash = 2166136261u;
+
+	while (keylen--) {
+		hash ^= *p++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int cache_resize(struct cache *c, size_t size)
+{
+	struct cache_entry **buckets = calloc(size, sizeof *buckets);
+	size_t i;
+
+	if (!buckets)
+		return -1;
+
+	for (i = 0; i < c->size; i++) {
+		struct cache_entry *e, *next;
+
+		for (e = c->buckets[i]; e; e = next) {
+			next = e->next;
+			e->next = buckets[e->hash & (size -1)];
+			buckets[e->hash & (size -1)] = e;
+		}
+	}
+	free(c->buckets);
+	c->buckets = buckets;
+	c->size = size;
+	return 0;
+}
+
+void cache_free(struct cache *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->size; i++) {
+		struct cache_entry *e, *next;
+
+		for (e = c->buckets[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+	free(c->buckets);
+	memset(c, 0, sizeof *c);
+}
+
+struct cache_entry *cache_get(const struct cache *c,
+				const void *key, size_t keylen)
+{
+	uint32_t hash;
+	struct cache_entry *e;
+
+	if (!c->size)
+		return NULL;
+
+	hash = cache_hash(key, keylen);
+	for (e = c->buckets[hash & (c->size -1)]; e; e = e->next) {
+		if (e->hash == hash && e->keylen == keylen &&
+		    !memcmp(e->data, key, keylen))
+			return e;
+	}
+	return NULL;
+}
+
+/* Inserts or replaces the value for "key". An existing entry keeps its
+ * "version" and "mark" but may be moved in memory.
+ * Returns NULL if the memory allocation failed.
+ */
+struct cache_entry *cache_put(struct cache *c, const void *key, size_t keylen,
+				const void *value, size_t len)
+{
+	struct cache_entry *e, **pe;
+	uint32_t hash;
+
+	if (c->count >= c->size &&
+	    cache_resize(c, c->size ? c->size * 2 : CACHE_MIN_SIZE) < 0)
+		return NULL;
+
+	hash = cache_hash(key, keylen);
+	for (pe = &c->buckets[hash & (c->size -1)]; *pe; pe = &(*pe)->next) {
+		e = *pe;
+		if (e->hash == hash && e->keylen == keylen &&
+		    !memcmp(e->data, key, keylen))
+			break;
+	}
+	e = *pe;
+	if (!e || e->len != len) {
+		struct cache_entry *n;
+
+		n = realloc(e, sizeof *e + CACHE_ALIGN(keylen) + len);
+		if (!n)
+			return NULL;
+		if (!e) {
+			memset(n, 0, sizeof *n);
+			n->hash = hash;
+			n->keylen = keylen;
+			memcpy(n->data, key, keylen);
+			c->count++;
+		}
+		*pe = e = n;
+		e->len = len;
+	}
+	if (value)
+		memcpy(cache_value(e), value, len);
+	return e;
+}
+
+void cache_del(struct cache *c, struct cache_entry *entry)
+{
+	struct cache_entry **pe;
+
+	for (pe = &c->buckets[entry->hash & (c->size -1)]; *pe;
+	     pe = &(*pe)->next)
+	{
+		if (*pe == entry) {
+			*pe = entry->next;
+			free(entry);
+			c->count--;
+			return;
+		}
+	}
+}
+
+/* Iterates over all entries: Starts with "entry" = NULL.
+ * The returned entry may be deleted before calling cache_next() again,
+ * if the next entry was fetched before.
+ */
+struct cache_entry *cache_next(const struct cache *c,
+				const struct cache_entry *entry)
+{
+	size_t i = 0;
+
+	if (entry) {
+		if (entry->next)
+			return entry->next;
+		i = (entry->hash & (c->size -1)) +1;
+	}
+	for (; i < c->size; i++) {
+		if (c->buckets[i])
+			return c->buckets[i];
+	}
+	return NULL;
+}
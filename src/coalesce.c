@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2021 Christian Hohnstaedt
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libmnl/libmnl.h>
+
+#include "netlink.h"
+
+/* Coalescing of events with the socket option "coalesce": Only the latest
+ * message per object is kept until the window expired or, without a
+ * window, until the end of the event() call. The objects are identified
+ * like in the state copy by the "key" function of their group.
+ * The entries are emitted in the order of their first event, their
+ * cache "version" is the sequence number of it.
+ */
+
+struct coalesced {
+	/* Timestamp of the first event */
+	lua_Integer stamp;
+	/* Type of the first event */
+	uint16_t first;
+	/* The object was known before the first event */
+	uint16_t existed;
+	struct nlmsghdr nlh[];
+};
+
+/* Holds back the message of the event socket.
+ * A "del" after a "new" of an object, which was not in the state copy
+ * before, cancels both. Without the state copy, the object may have
+ * existed and only the "del" is kept.
+ * Returns 0 if the message can not be coalesced.
+ */
+int coalesce_add(struct userdata *userdata, struct nlmsghdr *nlh)
+{
+	const struct rtmgrp *rtmgrp = rtmgrp_by_type(nlh->nlmsg_type);
+	unsigned char key[NL_KEY_MAX + sizeof(uint16_t)];
+	struct coalesced *c, prev;
+	struct cache_entry *e;
+	size_t keylen;
+	uint16_t type;
+
+	if (!rtmgrp || !rtmgrp->key ||
+	    nlh->nlmsg_len < MNL_NLMSG_HDRLEN + MNL_ALIGN(rtmgrp->hdrlen))
+		return 0;
+	type = rtmgrp->new;
+	memcpy(key, &type, sizeof type);
+	/* The key function may clear volatile header values,
+	 * like it does in the state copy
+	 */
+	keylen = rtmgrp->key(nlh, key + sizeof type);
+	if (!keylen)
+		return 0;
+	keylen += sizeof type;
+
+	e = cache_get(&userdata->coalesce, key, keylen);
+	if (e) {
+		c = cache_value(e);
+		prev = *c;
+		userdata->coalesced++;
+		if (nlh->nlmsg_type == rtmgrp->del &&
+		    prev.first == rtmgrp->new && !prev.existed)
+		{
+			/* Created and deleted within the window */
+			cache_del(&userdata->coalesce, e);
+			userdata->coalesced++;
+			return 1;
+		}
+	} else {
+		prev.stamp = timestamp();
+		prev.first = nlh->nlmsg_type;
+		prev.existed = state_has(userdata, rtmgrp, nlh) != 0;
+	}
+
+	e = cache_put(&userdata->coalesce, key, keylen, NULL,
+			sizeof *c + nlh->nlmsg_len);
+	if (!e)
+		return luaL_error(userdata->L, "Out of memory for coalescing");
+	if (!e->version)
+		e->version = ++userdata->coalesce_seq;
+	c = cache_value(e);
+	*c = prev;
+	memcpy(c->nlh, nlh, nlh->nlmsg_len);
+	return 1;
+}
+
+static int coalesce_cmp(const void *a, const void *b)
+{
+	const struct cache_entry *ea = *(const struct cache_entry **)a;
+	const struct cache_entry *eb = *(const struct cache_entry **)b;
+
+	return ea->version < eb->version ? -1 : ea->version > eb->version;
+}
+
+/* Emits the entries whose window expired or all with "all" set */
+void coalesce_flush(struct userdata *userdata, lua_State *L, int all)
+{
+	struct cache_entry *e, **list;
+	lua_Integer now = timestamp();
+	size_t i, n = 0;
+
+	if (!userdata->coalesce.count)
+		return;
+	list = lua_newuserdata(L, userdata->coalesce.count * sizeof *list);
+	for (e = cache_next(&userdata->coalesce, NULL); e;
+	     e = cache_next(&userdata->coalesce, e))
+	{
+		const struct coalesced *c = cache_value(e);
+
+		if (all || now - c->stamp >= userdata->coalesce_window)
+			list[n++] = e;
+	}
+	qsort(list, n, sizeof *list, coalesce_cmp);
+
+	for (i = 0; i < n; i++) {
+		struct coalesced *c = cache_value(list[i]);
+		const struct rtmgrp *rtmgrp = update_message(userdata, c->nlh);
+
+		/* Deleted afterwards: It is emitted again by the next call,
+		 * if a handler fails
+		 */
+		if (rtmgrp)
+			emit_message(userdata, rtmgrp, c->nlh);
+		cache_del(&userdata->coalesce, list[i]);
+	}
+	lua_pop(L, 1);
+}
+
+/* Returns the milliseconds until the next window expires or -1 */
+int coalesce_timeout(const struct userdata *userdata)
+{
+	const struct cache_entry *e;
+	lua_Integer next = -1, now;
+
+	if (userdata->coalesce_window <= 0 || !userdata->coalesce.count)
+		return -1;
+	now = timestamp();
+	for (e = cache_next(&userdata->coalesce, NULL); e;
+	     e = cache_next(&userdata->coalesce, e))
+	{
+		const struct coalesced *c = cache_value(e);
+		lua_Integer left = c->stamp + userdata->coalesce_window - now;
+
+		if (left < 0)
+			left = 0;
+		if (next < 0 || left < next)
+			next = left;
+	}
+	return next;
+}
@@ -0,0 +1,976 @@
+/*
+ * Copyright (c) 2021 Christian Hohnstaedt
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <libmnl/libmnl.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "netlink.h"
+
+/* State of a query_iter() iterator. It dumps the groups one after
+ * another on its own netlink socket and decodes one message per step
+ * directly from the receive buffer.
+ */
+struct query_iter {
+	struct mnl_socket *nl;
+	int groups;
+	const struct rtmgrp *current;
+	unsigned int seq;
+	/* The running dump was interrupted (NLM_F_DUMP_INTR) */
+	int intr;
+	int len;
+	const struct nlmsghdr *next;
+	/* Field set of the query_iter() call or NULL */
+	const uint32_t *fields;
+	struct dump_filter filter;
+	int filtered;
+	size_t bufsize;
+	char buf[];
+};
+
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK 12
+#endif
+
+/* Returns a new netlink socket without multicast groups for dumps.
+ * Strict checking lets the kernel apply the filters of the dump requests.
+ * Older kernels ignore them, the "match" functions of the groups
+ * filter the replies anyway.
+ */
+struct mnl_socket *dump_socket(struct userdata *userdata, lua_State *L)
+{
+	struct mnl_socket *nl = NULL;
+	int one = 1, prev;
+
+	/* In the namespace of the socket */
+	if (netns_enter(userdata->netns, &prev) == 0) {
+		nl = mnl_socket_open2(NETLINK_ROUTE, SOCK_CLOEXEC);
+		netns_leave(prev);
+	}
+	if (nl == NULL)
+		luaL_error(L, "mnl_socket_open(): %s", strerror(errno));
+
+	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		int errn = errno;
+		mnl_socket_close(nl);
+		luaL_error(L, "mnl_socket_bind(): %s", strerror(errn));
+	}
+	mnl_socket_setsockopt(nl, NETLINK_GET_STRICT_CHK, &one, sizeof one);
+	return nl;
+}
+
+static const char *const filter_families[] = {
+	"AF_UNSPEC", "AF_INET", "AF_INET6", "AF_BRIDGE", NULL
+};
+static const int filter_family_values[] = {
+	AF_UNSPEC, AF_INET, AF_INET6, AF_BRIDGE
+};
+
+/* Returns the index of the string entry "which" of the table in "list" */
+static int filter_option(lua_State *L, int idx, const char *which,
+			const char *const list[])
+{
+	const char *value;
+	int i;
+
+	lua_getfield(L, idx, which);
+	value = lua_tostring(L, -1);
+	lua_pop(L, 1);
+	if (!value)
+		return -1;
+	for (i = 0; list[i]; i++) {
+		if (!strcmp(list[i], value))
+			return i;
+	}
+	return luaL_error(L, "Invalid %s '%s'", which, value);
+}
+
+/* Reads the filter of a dump from the optional table at "idx":
+ * { family = "AF_INET6", index = 2, table = 254, protocol = 4,
+ *   state = "reachable" }
+ * "state" may also be an array of neighbour states.
+ * Returns 1 if a table was given, 0 otherwise.
+ */
+int filter_from_table(lua_State *L, int idx, struct dump_filter *filter)
+{
+	int i;
+
+	memset(filter, 0, sizeof *filter);
+	if (!lua_istable(L, idx))
+		return 0;
+
+	i = filter_option(L, idx, "family", filter_families);
+	if (i >= 0)
+		filter->family = filter_family_values[i];
+	lua_getfield(L, idx, "state");
+	if (!lua_isnil(L, -1))
+		filter->state = neigh_state_bits(L, lua_gettop(L));
+	lua_pop(L, 1);
+	filter->index = opt_integer(L, idx, "index", 0);
+	filter->table = opt_integer(L, idx, "table", 0);
+	filter->protocol = opt_integer(L, idx, "protocol", 0);
+	return 1;
+}
+
+static void query_iter_close(struct query_iter *it)
+{
+	if (it->nl)
+		mnl_socket_close(it->nl);
+	it->nl = NULL;
+}
+
+static int query_iter_gc(lua_State *L)
+{
+	query_iter_close(lua_touserdata(L, 1));
+	return 0;
+}
+
+/* A filtered dump fails for an unknown interface or routing table,
+ * it is just empty then
+ */
+static int filter_empty(int err)
+{
+	return err == ENODEV || err == ENOENT;
+}
+
+/* Returns the next message of the running dump, NULL if it is finished.
+ * The entries already returned can not be taken back, so an interrupted
+ * dump raises an error at its end instead of being repeated.
+ */
+static const struct nlmsghdr *query_iter_msg(lua_State *L,
+					struct query_iter *it)
+{
+	unsigned int portid = mnl_socket_get_portid(it->nl);
+
+	while (it->len > 0 && mnl_nlmsg_ok(it->next, it->len)) {
+		const struct nlmsghdr *nlh = it->next;
+
+		it->next = mnl_nlmsg_next(nlh, &it->len);
+		if (!mnl_nlmsg_portid_ok(nlh, portid) ||
+		    !mnl_nlmsg_seq_ok(nlh, it->seq))
+			continue;
+		if (nlh->nlmsg_flags & NLM_F_DUMP_INTR)
+			it->intr = 1;
+
+		if (nlh->nlmsg_type == NLMSG_ERROR) {
+			const struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+			if (err->error && !(it->filtered &&
+					filter_empty(-err->error))) {
+				query_iter_close(it);
+				luaL_error(L, "Dump of %s: %s", it->current->name,
+						strerror(-err->error));
+			}
+		}
+		if (nlh->nlmsg_type == NLMSG_ERROR ||
+		    nlh->nlmsg_type == NLMSG_DONE)
+		{
+			if (it->intr) {
+				query_iter_close(it);
+				luaL_error(L, "Dump of %s: Interrupted",
+						it->current->name);
+			}
+			it->current = NULL;
+			it->len = 0;
+			break;
+		}
+		if (nlh->nlmsg_type >= NLMSG_MIN_TYPE)
+			return nlh;
+	}
+	return NULL;
+}
+
+/* Iterator function: Returns the next entry of the dump or nil */
+static int query_iter_step(lua_State *L)
+{
+	struct userdata *userdata = lua_touserdata(L, lua_upvalueindex(1));
+	struct query_iter *it = lua_touserdata(L, lua_upvalueindex(2));
+	struct rtmgrp *rtmgrp;
+	struct pollfd pfd = { .events = POLLIN };
+
+	if (!it->nl)
+		return 0;
+	pfd.fd = mnl_socket_get_fd(it->nl);
+	check_idle(userdata, L);
+	reset_call(userdata, L);
+	userdata->projection = it->fields ? it->fields :
+			userdata->projected ? userdata->fields : NULL;
+	userdata->filter = it->filtered ? &it->filter : NULL;
+
+	for (;;) {
+		const struct nlmsghdr *nlh = query_iter_msg(L, it);
+		const struct rtmgrp *group;
+		int ret;
+
+		if (nlh) {
+			group = update_message(userdata, nlh);
+			if (group && push_message(userdata, group, nlh))
+				return 1;
+			continue;
+		}
+		if (it->current) {
+			ret = poll(&pfd, 1, userdata->dump_timeout);
+			if (ret == 0) {
+				query_iter_close(it);
+				return luaL_error(L, "Timeout while dumping");
+			}
+			if (ret > 0)
+				ret = mnl_socket_recvfrom(it->nl, it->buf,
+							it->bufsize);
+			if (ret < 0 && errno != EINTR)
+				return luaL_error(L, "mnl_socket_recvfrom(): %s",
+							strerror(errno));
+			it->len = ret < 0 ? 0 : ret;
+			it->next = (const struct nlmsghdr *)it->buf;
+			continue;
+		}
+		for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp; rtmgrp++) {
+			if (it->groups & rtmgrp->group)
+				break;
+		}
+		if (rtmgrp == &__stop_rtmgrp) {
+			query_iter_close(it);
+			return 0;
+		}
+		it->groups &= ~rtmgrp->group;
+		it->current = rtmgrp;
+		it->intr = 0;
+		it->len = 0;
+		if (netlink_request(it->nl, rtmgrp, ++it->seq,
+					userdata->filter) < 0)
+			return luaL_error(L, "mnl_socket_sendto(): %s",
+						strerror(errno));
+	}
+}
+
+/* Returns an iterator over the current values of all or a list of groups
+ * and an optional filter like query():
+ * for entry in nl:query_iter{ route = true } do ... end
+ * In contrast to query(), only one entry is decoded at a time.
+ */
+int nlfunc_query_iter(lua_State *L)
+{
+	struct userdata *userdata = get_userdata(L);
+	struct query_iter *it;
+	int groups = userdata->groups;
+	struct dump_filter filter;
+	uint32_t *fields = NULL;
+	int filtered = filter_from_table(L, 3, &filter);
+
+	if (lua_istable(L, 2)) {
+		groups = groups_from_set(L, 2);
+		fields = lua_newuserdata(L, RTMGRP_COUNT * sizeof *fields);
+		if (!fields_from_set(L, 2, fields))
+			fields = NULL;
+		lua_replace(L, 2);
+	}
+	lua_settop(L, fields ? 2 : 1);
+
+	it = lua_newuserdata(L, sizeof *it + userdata->bufsize);
+	memset(it, 0, sizeof *it);
+	it->groups = groups;
+	it->fields = fields;
+	it->filter = filter;
+	it->filtered = filtered;
+	it->bufsize = userdata->bufsize;
+	luaL_setmetatable(L, "mnl.query_iter");
+	it->nl = dump_socket(userdata, L);
+
+	/* Upvalues: socket, iterator and the referenced field set */
+	if (fields)
+		lua_insert(L, 2);
+	lua_pushcclosure(L, query_iter_step, fields ? 3 : 2);
+	return 1;
+}
+
+/* Dump socket of a group for query(). "busy" is set while a dump is
+ * running: If it was aborted by an error, the socket is replaced.
+ */
+struct dump_slot {
+	struct mnl_socket *nl;
+	unsigned int seq;
+	int busy;
+};
+
+/* A query of query_start(), dumped on the event socket. Its groups are
+ * dumped one after another, since the kernel runs one dump per socket.
+ */
+struct async_query {
+	struct async_query *next;
+	lua_Integer handle;
+	/* Groups left, the one being dumped and its sequence number */
+	int groups;
+	const struct rtmgrp *current;
+	unsigned int seq;
+	int tries, intr;
+	struct dump_filter filter;
+	int filtered;
+};
+
+void dump_free(struct userdata *userdata)
+{
+	struct async_query *a, *next;
+	size_t i;
+
+	for (a = userdata->async; a; a = next) {
+		next = a->next;
+		free(a);
+	}
+	userdata->async = NULL;
+
+	if (!userdata->dumps)
+		return;
+	for (i = 0; i < RTMGRP_COUNT; i++) {
+		if (userdata->dumps[i].nl)
+			mnl_socket_close(userdata->dumps[i].nl);
+	}
+	free(userdata->dumps);
+	userdata->dumps = NULL;
+}
+
+/* Returns the idle dump socket of the group */
+static struct dump_slot *dump_slot(struct userdata *userdata, lua_State *L,
+			const struct rtmgrp *rtmgrp)
+{
+	struct dump_slot *slot;
+
+	if (!userdata->dumps) {
+		userdata->dumps = calloc(RTMGRP_COUNT, sizeof *userdata->dumps);
+		if (!userdata->dumps)
+			luaL_error(L, "calloc(): %s", strerror(errno));
+	}
+	slot = userdata->dumps + rtmgrp_index(rtmgrp);
+	if (slot->busy) {
+		mnl_socket_close(slot->nl);
+		slot->nl = NULL;
+		slot->busy = 0;
+	}
+	if (!slot->nl)
+		slot->nl = dump_socket(userdata, L);
+	return slot;
+}
+
+/* A dump of one group in dump_parallel(). Its entries are collected in
+ * the table at stack index "table" until all dumps are done.
+ */
+struct dump_run {
+	struct dump_slot *slot;
+	const struct rtmgrp *rtmgrp;
+	int table;
+	lua_Integer count;
+	int tries;
+	/* The dump was interrupted, the rest of its replies is dropped */
+	int intr;
+};
+
+static void dump_start(struct userdata *userdata, lua_State *L,
+			struct dump_run *run)
+{
+	struct dump_slot *slot = run->slot;
+
+	if (netlink_request(slot->nl, run->rtmgrp, ++slot->seq,
+				userdata->filter) < 0)
+		luaL_error(L, "mnl_socket_sendto(): %s", strerror(errno));
+	slot->busy = 1;
+	run->intr = 0;
+	run->count = 0;
+}
+
+/* Returns MNL_CB_STOP if the datagram finishes the dump "seq" */
+static int dump_drain(const char *buf, int len, unsigned int seq)
+{
+	const struct nlmsghdr *nlh = (const struct nlmsghdr *)buf;
+
+	for (; mnl_nlmsg_ok(nlh, len); nlh = mnl_nlmsg_next(nlh, &len)) {
+		if (nlh->nlmsg_seq == seq && (nlh->nlmsg_type == NLMSG_DONE ||
+				nlh->nlmsg_type == NLMSG_ERROR))
+			return MNL_CB_STOP;
+	}
+	return MNL_CB_OK;
+}
+
+/* Processes a datagram of the dump "run".
+ * Returns MNL_CB_STOP if the dump is complete, MNL_CB_OK if more replies
+ * follow and MNL_CB_ERROR if it failed.
+ */
+static int dump_recv(struct userdata *userdata, lua_State *L,
+			struct dump_run *run, char *buf, int len)
+{
+	struct dump_slot *slot = run->slot;
+	int result = userdata->result, ret = MNL_CB_OK;
+	lua_Integer nresults = userdata->nresults;
+
+	if (!run->intr) {
+		userdata->result = run->table;
+		userdata->nresults = run->count;
+		ret = mnl_cb_run(buf, len, slot->seq,
+				mnl_socket_get_portid(slot->nl),
+				data_cb, userdata);
+		run->count = userdata->nresults;
+		userdata->result = result;
+		userdata->nresults = nresults;
+
+		if (ret == MNL_CB_ERROR && userdata->filter &&
+		    filter_empty(errno))
+			return MNL_CB_STOP;
+		/* libmnl stops at the first NLM_F_DUMP_INTR message */
+		if (ret == MNL_CB_ERROR && errno == EINTR) {
+			if (run->tries >= NL_DUMP_RETRIES)
+				return MNL_CB_ERROR;
+			run->intr = 1;
+		}
+	}
+	if (!run->intr)
+		return ret;
+
+	/* Repeat the dump once the interrupted one is done */
+	if (dump_drain(buf, len, slot->seq) == MNL_CB_STOP) {
+		run->tries++;
+		lua_newtable(L);
+		lua_replace(L, run->table);
+		dump_start(userdata, L, run);
+	}
+	return MNL_CB_OK;
+}
+
+/* Dumps the groups in parallel: Every group is dumped on its own socket,
+ * since the kernel runs only one dump per socket, and the replies are
+ * processed as they arrive. A dump is complete with the NLMSG_DONE of its
+ * sequence number. A dump interrupted by changes (NLM_F_DUMP_INTR) is
+ * repeated, so event handlers may see its entries twice. The entries of
+ * the result array are appended in group order at the end.
+ */
+void dump_parallel(struct userdata *userdata, lua_State *L, int groups)
+{
+	const struct rtmgrp *rtmgrp;
+	struct pollfd *pfd;
+	struct dump_run *runs;
+	lua_Integer deadline = timestamp() + userdata->dump_timeout;
+	int top = lua_gettop(L);
+	char *buf;
+	size_t i, n = 0, running;
+
+	/* Scratch memory: poll array, dumps and the receive buffer */
+	pfd = lua_newuserdata(L, RTMGRP_COUNT * (sizeof *pfd + sizeof *runs) +
+				userdata->bufsize);
+	runs = (struct dump_run *)(pfd + RTMGRP_COUNT);
+	buf = (char *)(runs + RTMGRP_COUNT);
+
+	for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp; rtmgrp++) {
+		struct dump_run *run = runs + n;
+
+		if (!(groups & rtmgrp->group))
+			continue;
+		memset(run, 0, sizeof *run);
+		run->rtmgrp = rtmgrp;
+		run->slot = dump_slot(userdata, L, rtmgrp);
+		lua_newtable(L);
+		run->table = lua_gettop(L);
+		dump_start(userdata, L, run);
+		pfd[n].fd = mnl_socket_get_fd(run->slot->nl);
+		pfd[n].events = POLLIN;
+		n++;
+	}
+
+	for (running = n; running; ) {
+		lua_Integer timeout = deadline - timestamp();
+		int ret;
+
+		if (timeout <= 0)
+			luaL_error(L, "Timeout while dumping");
+		ret = poll(pfd, n, timeout);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			luaL_error(L, "poll(): %s", strerror(errno));
+
+		for (i = 0; i < n; i++) {
+			struct dump_run *run = runs + i;
+
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			ret = mnl_socket_recvfrom(run->slot->nl, buf,
+						userdata->bufsize);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret >= 0)
+				ret = dump_recv(userdata, L, run, buf, ret);
+			if (ret == MNL_CB_ERROR)
+				luaL_error(L, "Dump of %s: %s", run->rtmgrp->name,
+					errno == EINTR ? "Interrupted too often" :
+					strerror(errno));
+			if (ret == MNL_CB_OK)
+				continue;
+			run->slot->busy = 0;
+			pfd[i].fd = -1;
+			running--;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		lua_Integer j;
+
+		for (j = 1; j <= runs[i].count; j++) {
+			lua_rawgeti(L, runs[i].table, j);
+			lua_rawseti(L, userdata->result, ++userdata->nresults);
+		}
+	}
+	lua_settop(L, top);
+}
+
+/* A dump of one group of a socket in dump_threads(). The worker thread
+ * keeps copies of the replies in "data", they are decoded by lua after
+ * all dumps are done. "err" is the errno of a failed dump.
+ */
+struct dump_job {
+	struct userdata *userdata;
+	const struct rtmgrp *rtmgrp;
+	struct dump_slot *slot;
+	const struct dump_filter *filter;
+	int timeout;
+	int tries;
+	int err;
+	char *data;
+	size_t len, size;
+};
+
+/* Jobs of a dump_threads() call, taken by the workers in turn */
+struct dump_jobs {
+	atomic_size_t next;
+	size_t count;
+	struct dump_job job[];
+};
+
+/* Appends a copy of the message, returns -1 if out of memory */
+static int job_append(struct dump_job *job, const struct nlmsghdr *nlh)
+{
+	size_t len = NLMSG_ALIGN(nlh->nlmsg_len);
+
+	if (job->len + len > job->size) {
+		size_t size = job->size ? 2 * job->size : 65536;
+		char *data;
+
+		while (size < job->len + len)
+			size *= 2;
+		data = realloc(job->data, size);
+		if (!data)
+			return -1;
+		job->data = data;
+		job->size = size;
+	}
+	memcpy(job->data + job->len, nlh, nlh->nlmsg_len);
+	job->len += len;
+	return 0;
+}
+
+/* Runs the dump of the job without lua. Returns 0 when it is done,
+ * 1 if it was interrupted (NLM_F_DUMP_INTR) and -1 with errno set.
+ */
+static int job_dump(struct dump_job *job, lua_Integer deadline)
+{
+	struct mnl_socket *nl = job->slot->nl;
+	unsigned int portid = mnl_socket_get_portid(nl);
+	unsigned int seq = ++job->slot->seq;
+	struct pollfd pfd = {
+		.fd = mnl_socket_get_fd(nl),
+		.events = POLLIN,
+	};
+	char buf[MNL_SOCKET_DUMP_SIZE];
+	int intr = 0;
+
+	if (netlink_request(nl, job->rtmgrp, seq, job->filter) < 0)
+		return -1;
+
+	for (;;) {
+		const struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+		lua_Integer timeout = deadline - timestamp();
+		int len, ret;
+
+		if (timeout <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0 && errno != EINTR)
+			return -1;
+		if (ret <= 0)
+			continue;
+		len = mnl_socket_recvfrom(nl, buf, sizeof buf);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			return -1;
+
+		for (; mnl_nlmsg_ok(nlh, len); nlh = mnl_nlmsg_next(nlh, &len)) {
+			if (!mnl_nlmsg_portid_ok(nlh, portid) ||
+			    !mnl_nlmsg_seq_ok(nlh, seq))
+				continue;
+			if (nlh->nlmsg_flags & NLM_F_DUMP_INTR)
+				intr = 1;
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				const struct nlmsgerr *err =
+					mnl_nlmsg_get_payload(nlh);
+				if (err->error && !(job->filter &&
+						filter_empty(-err->error))) {
+					errno = -err->error;
+					return -1;
+				}
+				return intr;
+			}
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return intr;
+			if (nlh->nlmsg_type >= NLMSG_MIN_TYPE && !intr &&
+			    job_append(job, nlh) < 0)
+				return -1;
+		}
+	}
+}
+
+/* Runs the dump of the job, repeats it if it was interrupted */
+static void job_run(struct dump_job *job)
+{
+	lua_Integer deadline = timestamp() + job->timeout;
+	int ret;
+
+	while ((ret = job_dump(job, deadline)) == 1) {
+		job->len = 0;
+		if (++job->tries > NL_DUMP_RETRIES) {
+			job->err = EINTR;
+			return;
+		}
+	}
+	if (ret < 0)
+		job->err = errno;
+}
+
+static void *dump_worker(void *arg)
+{
+	struct dump_jobs *jobs = arg;
+	size_t i;
+
+	while ((i = atomic_fetch_add(&jobs->next, 1)) < jobs->count)
+		job_run(jobs->job + i);
+	return NULL;
+}
+
+static int dump_jobs_gc(lua_State *L)
+{
+	struct dump_jobs *jobs = lua_touserdata(L, 1);
+	size_t i;
+
+	for (i = 0; i < jobs->count; i++) {
+		free(jobs->job[i].data);
+		jobs->job[i].data = NULL;
+	}
+	return 0;
+}
+
+/* Dumps the groups of the "n" sockets on a pool of up to "threads" worker
+ * threads, one dump socket per group and socket. The workers only receive
+ * and keep copies of the replies. They are decoded afterwards in the order
+ * of the sockets and groups and appended to the array at stack index
+ * "result" or passed to the event handlers.
+ * "groups" of 0 dumps all groups of each socket.
+ */
+void dump_threads(lua_State *L, int result, struct userdata **users, size_t n,
+			int groups, const struct dump_filter *filter, int threads)
+{
+	const struct rtmgrp *rtmgrp;
+	struct dump_jobs *jobs;
+	pthread_t *tids;
+	size_t i, count = 0;
+	int top = lua_gettop(L), started = 0;
+
+	jobs = lua_newuserdata(L, sizeof *jobs +
+				n * RTMGRP_COUNT * sizeof *jobs->job);
+	atomic_init(&jobs->next, 0);
+	jobs->count = 0;
+	luaL_setmetatable(L, "mnl.dump_jobs");
+
+	for (i = 0; i < n; i++) {
+		struct userdata *userdata = users[i];
+		int g = groups ? groups : userdata->groups;
+
+		userdata->L = L;
+		userdata->result = result;
+		userdata->nresults = lua_rawlen(L, result);
+		userdata->resyncing = NULL;
+		userdata->nsid = -1;
+		/* One dump for the ethtool settings of all links */
+		if (g & RTMGRP_LINK)
+			ethtool_dump(userdata);
+
+		for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp;
+		     rtmgrp++)
+		{
+			struct dump_job *job = jobs->job + count;
+
+			if (!(g & rtmgrp->group))
+				continue;
+			memset(job, 0, sizeof *job);
+			job->userdata = userdata;
+			job->rtmgrp = rtmgrp;
+			job->filter = filter;
+			job->timeout = userdata->dump_timeout;
+			job->slot = dump_slot(userdata, L, rtmgrp);
+			job->slot->busy = 1;
+			jobs->count = ++count;
+		}
+	}
+
+	/* The calling thread is a worker too. If no thread can be created,
+	 * it runs all dumps.
+	 */
+	if (threads > (int)count)
+		threads = count;
+	tids = lua_newuserdata(L, (threads > 1 ? threads : 1) * sizeof *tids);
+	while (started < threads - 1 &&
+	       pthread_create(tids + started, NULL, dump_worker, jobs) == 0)
+		started++;
+	dump_worker(jobs);
+	while (started)
+		pthread_join(tids[--started], NULL);
+
+	for (i = 0; i < count; i++) {
+		struct dump_job *job = jobs->job + i;
+
+		if (job->err)
+			luaL_error(L, "Dump of %s: %s", job->rtmgrp->name,
+					job->err == EINTR ?
+					"Interrupted too often" :
+					strerror(job->err));
+		job->slot->busy = 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct dump_job *job = jobs->job + i;
+		struct userdata *userdata = job->userdata;
+		const struct nlmsghdr *nlh = (struct nlmsghdr *)job->data;
+		int len = job->len;
+
+		userdata->nresults = lua_rawlen(L, result);
+		userdata->filter = filter;
+		for (; mnl_nlmsg_ok(nlh, len); nlh = mnl_nlmsg_next(nlh, &len))
+			data_cb(nlh, userdata);
+		userdata->filter = NULL;
+		free(job->data);
+		job->data = NULL;
+	}
+	lua_settop(L, top);
+}
+
+/* Returns the number of worker threads of the optional argument "idx",
+ * the number of online processors by default
+ */
+int dump_thread_count(lua_State *L, int idx)
+{
+	lua_Integer threads = luaL_optinteger(L, idx, 0);
+	long cpus;
+
+	if (threads < 0 || threads > 1024)
+		return luaL_error(L, "Invalid number of threads: %d",
+					(int)threads);
+	if (threads)
+		return threads;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
+
+/* Sends the dump request of the next group of the query.
+ * Returns 0 if no group is left, -1 with errno set on error.
+ */
+static int async_send(struct userdata *userdata, struct async_query *a)
+{
+	const struct rtmgrp *rtmgrp;
+
+	for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp; rtmgrp++) {
+		if (a->groups & rtmgrp->group)
+			break;
+	}
+	if (rtmgrp == &__stop_rtmgrp)
+		return 0;
+	if (rtmgrp != a->current)
+		a->tries = 0;
+	a->groups &= ~rtmgrp->group;
+	a->current = rtmgrp;
+	a->intr = 0;
+	/* Sequence number 0 is left to the multicast messages */
+	if (!++userdata->async_seq)
+		userdata->async_seq++;
+	a->seq = userdata->async_seq;
+	if (netlink_request(userdata->nl, rtmgrp, a->seq,
+				a->filtered ? &a->filter : NULL) < 0)
+		return -1;
+	return 1;
+}
+
+/* Removes the first query and pushes its "done" entry with the "error"
+ * message, if it failed
+ */
+static void async_pop(struct userdata *userdata, const char *error)
+{
+	struct async_query *a = userdata->async;
+	lua_State *L = userdata->L;
+
+	luaL_checkstack(L, 2, NULL);
+	userdata->async = a->next;
+	lua_createtable(L, 0, 4);
+	set_string(L, "event", "done");
+	set_integer(L, "stamp", timestamp());
+	set_integer(L, "query", a->handle);
+	if (error)
+		set_string(L, "error", error);
+	free(a);
+}
+
+/* Finishes the first query. The request of the next one is sent before
+ * the "done" entries are emitted, so a failing handler does not leave
+ * the rest of the queue unsent.
+ */
+static void async_done(struct userdata *userdata, const char *error)
+{
+	struct async_query *a;
+	lua_State *L = userdata->L;
+	int n = 1, first, i, ret;
+
+	async_pop(userdata, error);
+	while ((a = userdata->async) && (ret = async_send(userdata, a)) <= 0) {
+		async_pop(userdata, ret ? strerror(errno) : NULL);
+		n++;
+	}
+
+	first = lua_gettop(L) - n + 1;
+	for (i = 0; i < n; i++) {
+		lua_pushvalue(L, first + i);
+		emit_entry(userdata);
+	}
+	lua_pop(L, n);
+}
+
+/* Continues with the next group or query, after a dump finished */
+static void async_next(struct userdata *userdata)
+{
+	int ret = async_send(userdata, userdata->async);
+
+	if (ret <= 0)
+		async_done(userdata, ret ? strerror(errno) : NULL);
+}
+
+/* Processes a reply to the dump requests of query_start(), received
+ * on the event socket. The entries have the handle as "query".
+ */
+void async_message(struct userdata *userdata, const struct nlmsghdr *nlh)
+{
+	struct async_query *a = userdata->async;
+	const struct rtmgrp *rtmgrp;
+
+	if (!a || nlh->nlmsg_seq != a->seq)
+		return;
+	if (nlh->nlmsg_flags & NLM_F_DUMP_INTR)
+		a->intr = 1;
+
+	if (nlh->nlmsg_type == NLMSG_ERROR) {
+		const struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+
+		if (err->error && !(a->filtered && filter_empty(-err->error))) {
+			async_done(userdata, strerror(-err->error));
+			return;
+		}
+	} else if (nlh->nlmsg_type != NLMSG_DONE) {
+		if (nlh->nlmsg_type < NLMSG_MIN_TYPE)
+			return;
+		userdata->filter = a->filtered ? &a->filter : NULL;
+		userdata->query = a->handle;
+		rtmgrp = update_message(userdata, nlh);
+		if (rtmgrp)
+			emit_message(userdata, rtmgrp, nlh);
+		userdata->query = 0;
+		userdata->filter = NULL;
+		return;
+	}
+
+	/* The dump of the group is done, repeat it if it was interrupted */
+	if (a->intr) {
+		if (++a->tries > NL_DUMP_RETRIES) {
+			async_done(userdata, "Interrupted too often");
+			return;
+		}
+		a->groups |= a->current->group;
+	}
+	async_next(userdata);
+}
+
+/* Starts the dumps of all or a set of groups with an optional filter
+ * like query() and returns a handle. The entries are received by event()
+ * with the handle as "query", followed by a "done" entry, also with an
+ * "error" message if the dump failed. Queries are dumped in turn.
+ */
+int nlfunc_query_start(lua_State *L)
+{
+	struct userdata *userdata = get_userdata(L);
+	struct async_query *a, **pa;
+	struct dump_filter filter;
+	int groups = userdata->groups, one = 1;
+	int filtered = filter_from_table(L, 3, &filter);
+
+	if (lua_istable(L, 2))
+		groups = groups_from_set(L, 2);
+	if (!groups)
+		return luaL_error(L, "No netlink groups");
+
+	a = calloc(1, sizeof *a);
+	if (!a)
+		return luaL_error(L, "calloc(): %s", strerror(errno));
+	a->handle = ++userdata->async_handle;
+	a->groups = groups;
+	a->filter = filter;
+	a->filtered = filtered;
+
+	for (pa = &userdata->async; *pa; pa = &(*pa)->next)
+		;
+	*pa = a;
+	if (a == userdata->async) {
+		mnl_socket_setsockopt(userdata->nl, NETLINK_GET_STRICT_CHK,
+					&one, sizeof one);
+		if (async_send(userdata, a) < 0) {
+			int errn = errno;
+
+			userdata->async = NULL;
+			free(a);
+			return luaL_error(L, "mnl_socket_sendto(): %s",
+						strerror(errn));
+		}
+	}
+	lua_pushinteger(L, a->handle);
+	return 1;
+}
+
+/* Registers the metatables of the dump objects */
+void dump_init(lua_State *L)
+{
+	if (luaL_newmetatable(L, "mnl.query_iter")) {
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, query_iter_gc);
+		lua_rawset(L, -3);
+	}
+	lua_pop(L, 1);
+	if (luaL_newmetatable(L, "mnl.dump_jobs")) {
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, dump_jobs_gc);
+		lua_rawset(L, -3);
+	}
+	lua_pop(L, 1);
+}
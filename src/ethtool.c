@@ -7,30 +7,541 @@
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
 
 #include <netinet/in.h>
 
+#include <libmnl/libmnl.h>
 #include <linux/if.h>
 #include <linux/sockios.h>
 #include <linux/ethtool.h>
+#include <linux/genetlink.h>
+#include <linux/ethtool_netlink.h>
 
 #include "netlink.h"
 
-int netlink_ethtool(lua_State *L)
+/* Cached ethtool settings of an interface. They are valid as long as
+ * the carrier and operational state ("link") of the interface is the same.
+ */
+struct ethtool_info {
+	uint32_t link;
+	uint32_t speed;
+	uint8_t duplex, autoneg;
+	int err;
+};
+
+/* "link" of settings from a dump: valid for the next seen link state */
+#define ETHTOOL_LINK_ANY UINT32_MAX
+
+/* Generic netlink backend: A socket for LINKMODES_GET requests and
+ * one subscribed to the "monitor" group for change notifications.
+ * "epfd" combines the monitor and the rtnetlink socket for fd().
+ */
+struct ethnl {
+	struct mnl_socket *req, *monitor;
+	uint16_t family;
+	unsigned int seq;
+	int epfd;
+};
+
+static int ethnl_get(struct userdata *userdata, uint32_t index,
+			struct ethtool_info *info);
+
+/* Reads the settings by the SIOCETHTOOL ioctl on the socket "fd".
+ * Returns 0 on success or the errno of the failed call.
+ */
+static int ethtool_ioctl(int fd, const char *ifname, struct ethtool_info *info)
 {
 	struct ethtool_cmd req;
 	struct ifreq ifr;
-	const char *ifname;
-	size_t len;
-	int fd;
+	size_t len = strlen(ifname);
 	uint32_t speed;
 
+	if (len >= sizeof ifr.ifr_name)
+		return EINVAL;
+
+	/* Setup our control structures. */
+	memcpy(ifr.ifr_name, ifname, len+1);
+	memset(&req, 0, sizeof(req));
+	req.cmd = ETHTOOL_GSET;
+
+	ifr.ifr_data = &req;
+	if (ioctl(fd, SIOCETHTOOL, &ifr) < 0)
+		return errno;
+
+	speed = ethtool_cmd_speed(&req);
+	info->speed = speed == UINT32_MAX ? 0 : speed;
+	info->duplex = req.duplex;
+	info->autoneg = req.autoneg;
+	return 0;
+}
+
+static void ethtool_push(struct callback_data *cbd,
+			const struct ethtool_info *info)
+{
+	push_integer(cbd, NLF_SPEED, info->speed);
+	push_string(cbd, NLF_DUPLEX, info->duplex ? "full" : "half");
+	push_bool(cbd, NLF_AUTONEG, info->autoneg);
+}
+
+/* Returns the control socket of the netlink socket, opens it if needed
+ * in its namespace
+ */
+static int ethtool_ioctl_fd(struct userdata *userdata)
+{
+	int prev;
+
+	if (userdata->ethtool_fd < 0 &&
+	    netns_enter(userdata->netns, &prev) == 0) {
+		userdata->ethtool_fd = socket(AF_INET,
+				SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_IP);
+		netns_leave(prev);
+	}
+	return userdata->ethtool_fd;
+}
+
+/* Sets "speed", "duplex" and "autoneg" of the interface in the table
+ * on top of the stack, as far as requested in "cbd->fields".
+ * Returns 0 on success or the errno of the failed call.
+ */
+int ethtool_get(struct callback_data *cbd, const char *ifname)
+{
+	struct ethtool_info info;
+	int fd, ret;
+
+	/* Open control socket. */
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_IP);
+	if (fd < 0)
+		return errno;
+
+	ret = ethtool_ioctl(fd, ifname, &info);
+	close(fd);
+	if (!ret)
+		ethtool_push(cbd, &info);
+	return ret;
+}
+
+/* Like ethtool_get() for link messages: The settings are cached per
+ * interface index by the netlink socket of "cbd" and only read again,
+ * if the carrier or operational state "link" changed.
+ */
+void ethtool_link(struct callback_data *cbd, uint32_t index,
+			const char *ifname, uint32_t link)
+{
+	struct userdata *userdata = cbd->userdata;
+	struct ethtool_info info;
+	struct cache_entry *e;
+	int fd;
+
+	if (!userdata) {
+		ethtool_get(cbd, ifname);
+		return;
+	}
+	e = cache_get(&userdata->ethtool, &index, sizeof index);
+	if (e) {
+		memcpy(&info, cache_value(e), sizeof info);
+		if (info.link == ETHTOOL_LINK_ANY) {
+			info.link = link;
+			memcpy(cache_value(e), &info, sizeof info);
+		}
+		if (info.link == link) {
+			if (!info.err)
+				ethtool_push(cbd, &info);
+			return;
+		}
+	}
+	memset(&info, 0, sizeof info);
+	info.link = link;
+	if (userdata->ethnl) {
+		info.err = ethnl_get(userdata, index, &info);
+	} else {
+		fd = ethtool_ioctl_fd(userdata);
+		info.err = fd < 0 ? errno : ethtool_ioctl(fd, ifname, &info);
+	}
+	if (!info.err)
+		ethtool_push(cbd, &info);
+	/* A failed cache update only costs another ioctl next time */
+	cache_put(&userdata->ethtool, &index, sizeof index, &info, sizeof info);
+}
+
+/* Drops the cached settings of a removed interface */
+void ethtool_forget(struct userdata *userdata, uint32_t index)
+{
+	struct cache_entry *e = cache_get(&userdata->ethtool,
+					&index, sizeof index);
+	if (e)
+		cache_del(&userdata->ethtool, e);
+}
+
+/* Closes the control sockets and frees the cache */
+void ethtool_free(struct userdata *userdata)
+{
+	struct ethnl *e = userdata->ethnl;
+
+	if (userdata->ethtool_fd >= 0)
+		close(userdata->ethtool_fd);
+	userdata->ethtool_fd = -1;
+	cache_free(&userdata->ethtool);
+
+	if (!e)
+		return;
+	if (e->req)
+		mnl_socket_close(e->req);
+	if (e->monitor)
+		mnl_socket_close(e->monitor);
+	if (e->epfd >= 0)
+		close(e->epfd);
+	free(e);
+	userdata->ethnl = NULL;
+}
+
+/* Looks up the id of the ethtool generic netlink family and
+ * of its "monitor" multicast group. Returns 0 on success.
+ */
+static int ethnl_resolve(struct ethnl *e, uint32_t *group)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	const struct nlattr *attr, *grp, *a;
+	struct genlmsghdr *genl;
+	int len;
+
+	nlh->nlmsg_type = GENL_ID_CTRL;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+	nlh->nlmsg_seq = ++e->seq;
+	genl = mnl_nlmsg_put_extra_header(nlh, sizeof *genl);
+	genl->cmd = CTRL_CMD_GETFAMILY;
+	genl->version = 1;
+	mnl_attr_put_strz(nlh, CTRL_ATTR_FAMILY_NAME, ETHTOOL_GENL_NAME);
+
+	if (mnl_socket_sendto(e->req, nlh, nlh->nlmsg_len) < 0)
+		return -1;
+	len = mnl_socket_recvfrom(e->req, buf, sizeof buf);
+	nlh = (struct nlmsghdr *)buf;
+	if (len < 0 || !mnl_nlmsg_ok(nlh, len) ||
+	    nlh->nlmsg_type != GENL_ID_CTRL)
+		return -1;
+
+	mnl_attr_for_each(attr, nlh, sizeof *genl) {
+		switch (mnl_attr_get_type(attr)) {
+		case CTRL_ATTR_FAMILY_ID:
+			e->family = mnl_attr_get_u16(attr);
+			break;
+		case CTRL_ATTR_MCAST_GROUPS:
+			mnl_attr_for_each_nested(grp, attr) {
+				const char *name = NULL;
+				uint32_t id = 0;
+
+				mnl_attr_for_each_nested(a, grp) {
+					if (mnl_attr_get_type(a) ==
+					    CTRL_ATTR_MCAST_GRP_NAME)
+						name = mnl_attr_get_str(a);
+					if (mnl_attr_get_type(a) ==
+					    CTRL_ATTR_MCAST_GRP_ID)
+						id = mnl_attr_get_u32(a);
+				}
+				if (name && !strcmp(name,
+						ETHTOOL_MCGRP_MONITOR_NAME))
+					*group = id;
+			}
+			break;
+		}
+	}
+	return e->family && *group ? 0 : -1;
+}
+
+/* Opens the generic netlink backend for the socket. If the kernel has
+ * no ethtool netlink interface, the ioctl is used as before.
+ */
+void ethnl_open(struct userdata *userdata)
+{
+	struct ethnl *e = calloc(1, sizeof *e);
+	struct epoll_event ev = { .events = EPOLLIN };
+	uint32_t group = 0;
+	int prev;
+
+	if (!e)
+		return;
+	userdata->ethnl = e;
+	e->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (netns_enter(userdata->netns, &prev) == 0) {
+		e->req = mnl_socket_open2(NETLINK_GENERIC, SOCK_CLOEXEC);
+		e->monitor = mnl_socket_open2(NETLINK_GENERIC,
+					SOCK_NONBLOCK | SOCK_CLOEXEC);
+		netns_leave(prev);
+	}
+	if (e->epfd < 0 || !e->req || !e->monitor ||
+	    mnl_socket_bind(e->req, 0, MNL_SOCKET_AUTOPID) < 0 ||
+	    mnl_socket_bind(e->monitor, 0, MNL_SOCKET_AUTOPID) < 0 ||
+	    ethnl_resolve(e, &group) < 0 ||
+	    mnl_socket_setsockopt(e->monitor, NETLINK_ADD_MEMBERSHIP,
+				&group, sizeof group) < 0)
+		goto fallback;
+
+	/* The socket itself or the signal of its receiver thread */
+	ev.data.fd = receiver_fd(userdata);
+	if (ev.data.fd < 0)
+		ev.data.fd = mnl_socket_get_fd(userdata->nl);
+	if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0)
+		goto fallback;
+	ev.data.fd = mnl_socket_get_fd(e->monitor);
+	if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0)
+		goto fallback;
+	return;
+
+fallback:
+	ethtool_free(userdata);
+}
+
+/* Returns the file descriptor to wait for rtnetlink and ethtool events,
+ * -1 without generic netlink backend
+ */
+int ethnl_fd(const struct userdata *userdata)
+{
+	return userdata->ethnl ? userdata->ethnl->epfd : -1;
+}
+
+/* Sends a LINKMODES_GET request for the interface or a dump
+ * of all interfaces if "index" is 0
+ */
+static int ethnl_request(struct ethnl *e, uint32_t index)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	struct genlmsghdr *genl;
+	struct nlattr *nest;
+
+	nlh->nlmsg_type = e->family;
+	nlh->nlmsg_flags = NLM_F_REQUEST | (index ? 0 : NLM_F_DUMP);
+	nlh->nlmsg_seq = ++e->seq;
+	genl = mnl_nlmsg_put_extra_header(nlh, sizeof *genl);
+	genl->cmd = ETHTOOL_MSG_LINKMODES_GET;
+	genl->version = ETHTOOL_GENL_VERSION;
+
+	nest = mnl_attr_nest_start(nlh, ETHTOOL_A_LINKMODES_HEADER);
+	if (index)
+		mnl_attr_put_u32(nlh, ETHTOOL_A_HEADER_DEV_INDEX, index);
+	/* The link mode bitsets are not used, keep them small */
+	mnl_attr_put_u32(nlh, ETHTOOL_A_HEADER_FLAGS,
+				ETHTOOL_FLAG_COMPACT_BITSETS);
+	mnl_attr_nest_end(nlh, nest);
+
+	return mnl_socket_sendto(e->req, nlh, nlh->nlmsg_len) < 0 ? -1 : 0;
+}
+
+/* Reads the settings of a LINKMODES reply or notification into "info".
+ * Returns the interface index and sets "ifname" if present.
+ */
+static uint32_t ethnl_parse(const struct nlmsghdr *nlh,
+			struct ethtool_info *info, const char **ifname)
+{
+	const struct nlattr *attr, *a;
+	uint32_t index = 0, speed;
+
+	mnl_attr_for_each(attr, nlh, sizeof(struct genlmsghdr)) {
+		switch (mnl_attr_get_type(attr)) {
+		case ETHTOOL_A_LINKMODES_HEADER:
+			mnl_attr_for_each_nested(a, attr) {
+				if (mnl_attr_get_type(a) ==
+				    ETHTOOL_A_HEADER_DEV_INDEX &&
+				    mnl_attr_validate(a, MNL_TYPE_U32) == 0)
+					index = mnl_attr_get_u32(a);
+				if (mnl_attr_get_type(a) ==
+				    ETHTOOL_A_HEADER_DEV_NAME && ifname &&
+				    mnl_attr_validate(a, MNL_TYPE_STRING) == 0)
+					*ifname = mnl_attr_get_str(a);
+			}
+			break;
+		case ETHTOOL_A_LINKMODES_AUTONEG:
+			info->autoneg = mnl_attr_get_u8(attr);
+			break;
+		case ETHTOOL_A_LINKMODES_SPEED:
+			speed = mnl_attr_get_u32(attr);
+			info->speed = speed == UINT32_MAX ? 0 : speed;
+			break;
+		case ETHTOOL_A_LINKMODES_DUPLEX:
+			info->duplex = mnl_attr_get_u8(attr) == DUPLEX_FULL;
+			break;
+		}
+	}
+	return index;
+}
+
+/* Stores the settings of the interface with the "link" of the cached
+ * entry or ETHTOOL_LINK_ANY
+ */
+static void ethnl_store(struct userdata *userdata, uint32_t index,
+			struct ethtool_info *info)
+{
+	struct cache_entry *e = cache_get(&userdata->ethtool,
+					&index, sizeof index);
+
+	info->link = ETHTOOL_LINK_ANY;
+	if (e)
+		memcpy(&info->link, cache_value(e), sizeof info->link);
+	info->err = 0;
+	cache_put(&userdata->ethtool, &index, sizeof index, info, sizeof *info);
+}
+
+/* Receives the replies of the last request. With "result", the single
+ * reply is stored there, otherwise all replies go to the cache.
+ * Returns 0 or an errno.
+ */
+static int ethnl_receive(struct userdata *userdata, struct ethtool_info *result)
+{
+	struct ethnl *e = userdata->ethnl;
+	char buf[MNL_SOCKET_DUMP_SIZE];
+	struct pollfd pfd = {
+		.fd = mnl_socket_get_fd(e->req),
+		.events = POLLIN,
+	};
+	unsigned int portid = mnl_socket_get_portid(e->req);
+
+	for (;;) {
+		const struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+		int len, ret = poll(&pfd, 1, userdata->dump_timeout);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret ? errno : ETIMEDOUT;
+		len = mnl_socket_recvfrom(e->req, buf, sizeof buf);
+		if (len < 0)
+			return errno;
+
+		for (; mnl_nlmsg_ok(nlh, len); nlh = mnl_nlmsg_next(nlh, &len)) {
+			struct ethtool_info info;
+			uint32_t index;
+
+			if (!mnl_nlmsg_portid_ok(nlh, portid) ||
+			    !mnl_nlmsg_seq_ok(nlh, e->seq))
+				continue;
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				const struct nlmsgerr *err =
+					mnl_nlmsg_get_payload(nlh);
+				return -err->error;
+			}
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (nlh->nlmsg_type != e->family)
+				continue;
+			if (result) {
+				ethnl_parse(nlh, result, NULL);
+				return 0;
+			}
+			memset(&info, 0, sizeof info);
+			index = ethnl_parse(nlh, &info, NULL);
+			if (index)
+				ethnl_store(userdata, index, &info);
+		}
+	}
+}
+
+/* Reads the settings of one interface by a LINKMODES_GET request */
+static int ethnl_get(struct userdata *userdata, uint32_t index,
+		struct ethtool_info *info)
+{
+	if (ethnl_request(userdata->ethnl, index) < 0)
+		return errno;
+	return ethnl_receive(userdata, info);
+}
+
+/* Fills the cache with the settings of all interfaces by one dump */
+void ethtool_dump(struct userdata *userdata)
+{
+	if (userdata->ethnl && ethnl_request(userdata->ethnl, 0) == 0)
+		ethnl_receive(userdata, NULL);
+}
+
+/* Emits an "ethtool" event with the changed settings */
+static void ethnl_emit(struct userdata *userdata, uint32_t index,
+			const char *ifname, const struct ethtool_info *info)
+{
+	lua_State *L = userdata->L;
+	struct callback_data cbd = {
+		.L = L,
+		.fields = NLF_ALL,
+		.userdata = userdata,
+	};
+
+	cbd.keys = push_keys(L);
+	lua_createtable(L, 0, 6);
+	lua_rawgeti(L, cbd.keys, NLF_STAMP +1);
+	lua_pushinteger(L, timestamp());
+	lua_rawset(L, -3);
+	lua_rawgeti(L, cbd.keys, NLF_EVENT +1);
+	lua_pushliteral(L, "ethtool");
+	lua_rawset(L, -3);
+	lua_rawgeti(L, cbd.keys, NLF_NETNS +1);
+	if (push_netns(userdata, L))
+		lua_rawset(L, -3);
+	else
+		lua_pop(L, 1);
+	push_integer(&cbd, NLF_INDEX, index);
+	if (ifname)
+		push_string(&cbd, NLF_NAME, ifname);
+	ethtool_push(&cbd, info);
+	lua_remove(L, cbd.keys);
+	emit_entry(userdata);
+}
+
+/* Reads the pending notifications of the "monitor" group, updates the
+ * cache and emits the changed settings
+ */
+void ethtool_monitor(struct userdata *userdata)
+{
+	struct ethnl *e = userdata->ethnl;
+	char buf[MNL_SOCKET_DUMP_SIZE];
+
+	if (!e)
+		return;
+	for (;;) {
+		const struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+		int len = mnl_socket_recvfrom(e->monitor, buf, sizeof buf);
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == ENOBUFS) {
+			/* Lost notifications: Read everything again */
+			cache_free(&userdata->ethtool);
+			continue;
+		}
+		if (len < 0)
+			break;
+
+		for (; mnl_nlmsg_ok(nlh, len); nlh = mnl_nlmsg_next(nlh, &len)) {
+			const struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+			struct ethtool_info info;
+			const char *ifname = NULL;
+			uint32_t index;
+
+			if (nlh->nlmsg_type != e->family ||
+			    genl->cmd != ETHTOOL_MSG_LINKMODES_NTF)
+				continue;
+			memset(&info, 0, sizeof info);
+			index = ethnl_parse(nlh, &info, &ifname);
+			if (!index)
+				continue;
+			ethnl_store(userdata, index, &info);
+			ethnl_emit(userdata, index, ifname, &info);
+		}
+	}
+}
+
+int netlink_ethtool(lua_State *L)
+{
+	struct callback_data cbd = { .L = L, .fields = NLF_ALL };
+	const char *ifname;
+	int ret, top;
+
 	if (lua_type(L, -1) == LUA_TSTRING) {
 		/* Replace string with interface name by table with
 		 * element "name" containing the interface name */
@@ -42,38 +553,20 @@ int netlink_ethtool(lua_State *L)
 	}
 	lua_pushliteral(L, "name");
 	lua_gettable(L, -2);
-	ifname = lua_tolstring(L, -1, &len);
+	ifname = lua_tostring(L, -1);
 	lua_pop(L, 1);
 
-	if (!ifname || len >= sizeof ifr.ifr_name)
-		return 1;
-
-	/* Setup our control structures. */
-	memcpy(ifr.ifr_name, ifname, len+1);
-
-	/* Open control socket. */
-	fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-	if (fd < 0)
-		return luaL_error(L, "socket(IPPROTO_IP): %s", strerror(errno));
-
-	memset(&req, 0, sizeof(req));
-	req.cmd = ETHTOOL_GSET;
-
-	ifr.ifr_data = &req;
-	if (ioctl(fd, SIOCETHTOOL, &ifr) < 0) {
-		close(fd);
-		if (errno != ENOTSUP)
-			return luaL_error(L, "ioctl(SIOCETHTOOL, '%s'): %s",
-					ifname, strerror(errno));
-
+	if (!ifname)
 		return 1;
-	}
-	close(fd);
 
-	speed = ethtool_cmd_speed(&req);
-	push_integer(L, "speed", speed == UINT32_MAX ? 0 : speed);
-	push_string(L, "duplex", req.duplex ? "full" : "half");
-	push_bool(L, "autoneg", req.autoneg);
+	top = lua_gettop(L);
+	cbd.keys = push_keys(L);
+	lua_pushvalue(L, top);
+	ret = ethtool_get(&cbd, ifname);
+	lua_settop(L, top);
+	if (ret && ret != EINVAL && ret != ENOTSUP)
+		return luaL_error(L, "ioctl(SIOCETHTOOL, '%s'): %s",
+				ifname, strerror(ret));
 
 	return 1;
 }
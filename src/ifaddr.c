@@ -5,6 +5,10 @@
 
 #include <lua.h>
 #include <lualib.h>
+#include <lauxlib.h>
+
+#include <stddef.h>
+#include <string.h>
 
 #include <libmnl/libmnl.h>
 #include <linux/rtnetlink.h>
@@ -19,24 +23,131 @@ static int parse_attr(const struct nlattr *attr, void *data)
 	switch (type) {
 	case IFA_LOCAL:
 	case IFA_ADDRESS:
-		push_ip(cbd->L, "ip", cbd->ifa->ifa_family, attr);
+		push_ip(cbd, NLF_IP, cbd->ifa->ifa_family, attr);
 	}
 	return MNL_CB_OK;
 }
 
 static int ifaddr_cb(const struct nlmsghdr *nlh, struct callback_data *cbd)
 {
-	push_integer(cbd->L, "index", cbd->ifa->ifa_index);
-	push_string(cbd->L, "family", af_to_str(cbd->ifa->ifa_family));
-	push_integer(cbd->L, "prefixlen", cbd->ifa->ifa_prefixlen);
-	push_integer(cbd->L, "scope", cbd->ifa->ifa_scope);
-	push_integer(cbd->L, "flags", cbd->ifa->ifa_flags);
+	push_integer(cbd, NLF_INDEX, cbd->ifa->ifa_index);
+	push_string(cbd, NLF_FAMILY, af_to_str(cbd->ifa->ifa_family));
+	push_integer(cbd, NLF_PREFIXLEN, cbd->ifa->ifa_prefixlen);
+	push_integer(cbd, NLF_SCOPE, cbd->ifa->ifa_scope);
+	push_integer(cbd, NLF_FLAGS, cbd->ifa->ifa_flags);
 
 	return mnl_attr_parse(nlh, sizeof(*cbd->ifa), parse_attr, cbd);
 }
 
+/* Addresses are identified by interface, prefix length and local address */
+struct ifaddr_key {
+	uint32_t index;
+	uint8_t family, prefixlen, pad[2];
+	uint8_t addr[16];
+};
+
+static size_t ifaddr_key(struct nlmsghdr *nlh, unsigned char *key)
+{
+	const struct ifaddrmsg *ifa = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr, *addr = NULL;
+	struct ifaddr_key k;
+
+	mnl_attr_for_each(attr, nlh, sizeof *ifa) {
+		if (mnl_attr_get_type(attr) == IFA_LOCAL ||
+		    (mnl_attr_get_type(attr) == IFA_ADDRESS && !addr))
+			addr = attr;
+	}
+	memset(&k, 0, sizeof k);
+	k.index = ifa->ifa_index;
+	k.family = ifa->ifa_family;
+	k.prefixlen = ifa->ifa_prefixlen;
+	if (addr && mnl_attr_get_payload_len(addr) <= sizeof k.addr)
+		memcpy(k.addr, mnl_attr_get_payload(addr),
+				mnl_attr_get_payload_len(addr));
+	memcpy(key, &k, sizeof k);
+	return sizeof k;
+}
+
+/* Arguments: interface index, "address/prefixlen" */
+static size_t ifaddr_lua_key(lua_State *L, int idx, unsigned char *key)
+{
+	struct ifaddr_key k;
+	int family, prefixlen;
+
+	memset(&k, 0, sizeof k);
+	k.index = luaL_checkinteger(L, idx);
+	if (parse_addr(luaL_checkstring(L, idx +1), &family, k.addr,
+			&prefixlen) < 0)
+		return luaL_argerror(L, idx +1, "Invalid address");
+	k.family = family;
+	k.prefixlen = prefixlen;
+	memcpy(key, &k, sizeof k);
+	return sizeof k;
+}
+
+/* The kernel filters address dumps by family and interface index */
+static void ifaddr_request(struct nlmsghdr *nlh, const struct dump_filter *f)
+{
+	struct ifaddrmsg *ifa = mnl_nlmsg_get_payload(nlh);
+
+	ifa->ifa_family = f->family;
+	ifa->ifa_index = f->index;
+}
+
+static int ifaddr_match(const struct nlmsghdr *nlh,
+			const struct dump_filter *f)
+{
+	const struct ifaddrmsg *ifa = mnl_nlmsg_get_payload(nlh);
+
+	return (!f->family || ifa->ifa_family == f->family) &&
+		(!f->index || ifa->ifa_index == f->index);
+}
+
+static void ifaddr_bpf(struct nlbpf *p, const struct event_filter *f)
+{
+	if (f->nindex) {
+		bpf_load(p, 4, NLMSG_HDRLEN +
+				offsetof(struct ifaddrmsg, ifa_index));
+		bpf_in_set(p, 4, f->index, f->nindex);
+	}
+}
+
+/* Builds the address "ip" as "address/prefixlen" of the interface "index"
+ * with the optional "scope"
+ */
+static const char *ifaddr_build(struct nlmsghdr *nlh, lua_State *L, int idx)
+{
+	struct ifaddrmsg *ifa = mnl_nlmsg_get_payload(nlh);
+	int family = 0, len;
+	lua_Integer value;
+
+	if (write_integer(L, idx, "index", &value) <= 0 ||
+	    value <= 0 || value > UINT32_MAX)
+		return "Invalid index";
+	ifa->ifa_index = value;
+	if (write_addr(nlh, L, idx, "ip", IFA_LOCAL, &family, &len) <= 0)
+		return "Invalid address";
+	write_addr(nlh, L, idx, "ip", IFA_ADDRESS, &family, &len);
+	ifa->ifa_family = family;
+	ifa->ifa_prefixlen = len;
+
+	value = 0;
+	if (write_integer(L, idx, "scope", &value) < 0 ||
+	    value < 0 || value > 255)
+		return "Invalid scope";
+	ifa->ifa_scope = value;
+	return NULL;
+}
+
 struct rtmgrp ifaddr_rtmgrp = {
-	"ifaddr", RTMGRP_IPV4_IFADDR, ifaddr_cb,
-	RTM_NEWADDR, RTM_DELADDR, RTM_GETADDR
+	"ifaddr", RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR, ifaddr_cb,
+	RTM_NEWADDR, RTM_DELADDR, RTM_GETADDR,
+	sizeof(struct ifaddrmsg),
+	NLA_BIT(IFA_LOCAL) | NLA_BIT(IFA_ADDRESS),
+	ifaddr_key, ifaddr_lua_key,
+	6,
+	ifaddr_request, ifaddr_match,
+	ifaddr_bpf,
+	ifaddr_build
 };
 LUA_RTMGRP(ifaddr_rtmgrp);
@@ -4,7 +4,9 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <lua.h>
 #include <lualib.h>
@@ -16,83 +18,271 @@
 
 #include "netlink.h"
 
-void push_string(lua_State *L, const char *which, const char *value)
+/* Returns the CLOCK_MONOTONIC time in milliseconds */
+lua_Integer timestamp(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_nsec /(1000*1000) + tp.tv_sec *1000;
+}
+
+/* Returns the CLOCK_MONOTONIC time in microseconds */
+lua_Integer timestamp_us(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_nsec /1000 + tp.tv_sec *(1000*1000);
+}
+
+/* Names of the message fields in "enum nlfield" order */
+const char *const nlfield_names[NLF_MAX] = {
+	"index", "family", "running", "up", "mtu", "name", "hwaddr",
+	"speed", "duplex", "autoneg", "prefixlen", "scope", "flags", "ip",
+	"src", "dst", "gateway", "prefsrc", "metric", "state", "probes",
+};
+
+void set_string(lua_State *L, const char *which, const char *value)
 {
 	lua_pushstring(L, which);
 	lua_pushstring(L, value);
 	lua_settable(L, -3);
 }
 
-void push_integer(lua_State *L, const char *which, lua_Integer value)
+void set_integer(lua_State *L, const char *which, lua_Integer value)
 {
 	lua_pushstring(L, which);
 	lua_pushinteger(L, value);
 	lua_settable(L, -3);
 }
 
-void push_u32_attr(lua_State *L, const char *which, const struct nlattr *attr)
+/* Creates the registry tables of the field names:
+ * "mnl.fields" maps the names to the field ids and the key table
+ * holds the interned key strings indexed by field id +1.
+ */
+void fields_init(lua_State *L)
+{
+	int i;
+
+	lua_createtable(L, NLF_MAX +4, 0);
+	lua_createtable(L, 0, NLF_MAX +4);
+	for (i = 0; i < NLF_MAX; i++) {
+		lua_pushstring(L, nlfield_names[i]);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -4, i +1);
+		lua_pushinteger(L, i);
+		lua_rawset(L, -3);
+	}
+	lua_pushliteral(L, "event");
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, -4, NLF_EVENT +1);
+	lua_pushinteger(L, NLF_EVENT);
+	lua_rawset(L, -3);
+	lua_pushliteral(L, "stamp");
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, -4, NLF_STAMP +1);
+	lua_pushinteger(L, NLF_STAMP);
+	lua_rawset(L, -3);
+	lua_pushliteral(L, "netns");
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, -4, NLF_NETNS +1);
+	lua_pushinteger(L, NLF_NETNS);
+	lua_rawset(L, -3);
+	lua_pushliteral(L, "query");
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, -4, NLF_QUERY +1);
+	lua_pushinteger(L, NLF_QUERY);
+	lua_rawset(L, -3);
+	lua_setfield(L, LUA_REGISTRYINDEX, "mnl.fields");
+	lua_rawsetp(L, LUA_REGISTRYINDEX, nlfield_names);
+}
+
+/* Pushes the key table and returns its stack index for
+ * "callback_data.keys"
+ */
+int push_keys(lua_State *L)
+{
+	lua_rawgetp(L, LUA_REGISTRYINDEX, nlfield_names);
+	return lua_gettop(L);
+}
+
+static void push_key(struct callback_data *cbd, int field)
+{
+	lua_rawgeti(cbd->L, cbd->keys, field +1);
+}
+
+/* The push_...() functions set the message field in the table on top
+ * of the stack, if the field was requested in "cbd->fields".
+ * Otherwise the value is not even converted.
+ */
+void push_string(struct callback_data *cbd, enum nlfield field,
+			const char *value)
+{
+	if (!WANTED(cbd, field))
+		return;
+	push_key(cbd, field);
+	lua_pushstring(cbd->L, value);
+	lua_rawset(cbd->L, -3);
+}
+
+void push_integer(struct callback_data *cbd, enum nlfield field,
+			lua_Integer value)
+{
+	if (!WANTED(cbd, field))
+		return;
+	push_key(cbd, field);
+	lua_pushinteger(cbd->L, value);
+	lua_rawset(cbd->L, -3);
+}
+
+void push_u32_attr(struct callback_data *cbd, enum nlfield field,
+			const struct nlattr *attr)
 {
 	uint32_t *payload = mnl_attr_get_payload(attr);
-	push_integer(L, which, *payload);
+	push_integer(cbd, field, *payload);
 }
 
-void push_bool(lua_State *L, const char *which, int value)
+void push_bool(struct callback_data *cbd, enum nlfield field, int value)
 {
-	push_string(L, which, value ? "yes" : "no");
+	push_string(cbd, field, value ? "yes" : "no");
 }
 
-void push_ip(lua_State *L, const char *which, int family,
+void push_ip(struct callback_data *cbd, enum nlfield field, int family,
 			const struct nlattr *attr)
 {
 	char buf[INET6_ADDRSTRLEN];
+
+	if (!WANTED(cbd, field))
+		return;
 	inet_ntop(family, mnl_attr_get_payload(attr), buf, sizeof buf);
-	push_string(L, which, buf);
+	push_string(cbd, field, buf);
 }
 
-void push_cidr(lua_State *L, const char *which, int family,
+void push_cidr(struct callback_data *cbd, enum nlfield field, int family,
 			const struct nlattr *attr, int cidr)
 {
 	char buf[INET6_ADDRSTRLEN];
+
+	if (!WANTED(cbd, field))
+		return;
 	inet_ntop(family, mnl_attr_get_payload(attr), buf, sizeof buf);
-	lua_pushstring(L, which);
-	lua_pushfstring(L, "%s/%d", buf, cidr);
-	lua_settable(L, -3);
+	push_key(cbd, field);
+	lua_pushfstring(cbd->L, "%s/%d", buf, cidr);
+	lua_rawset(cbd->L, -3);
 }
 
-void push_hwaddr(lua_State *L, const char *which,
+void push_hwaddr(struct callback_data *cbd, enum nlfield field,
 			const struct nlattr *attr)
 {
 	const uint8_t *hwaddr = mnl_attr_get_payload(attr);
-	char addr[20], *p = addr;
+	char addr[3 * 32], *p = addr;
 	int i, max = mnl_attr_get_payload_len(attr);
 
+	if (!WANTED(cbd, field))
+		return;
 	if (mnl_attr_validate(attr, MNL_TYPE_BINARY) < 0)
-		luaL_error(L, "Invalid mnl_attr_type %d for hardware address",
+		luaL_error(cbd->L, "Invalid mnl_attr_type %d for hardware address",
 				(int)mnl_attr_get_type(attr));
+	if (max > 32)
+		max = 32;
+	*p = 0;
 	for (i = 0; i < max; i++) {
 		p += sprintf(p, "%02x", hwaddr[i]);
 		if (i + 1 != max)
 			*p++ = ':';
 	}
-	push_string(L, which, addr);
+	push_string(cbd, field, addr);
+}
+
+/* Parses an IPv4 or IPv6 address with optional "/prefixlen".
+ * "prefixlen" is set to the full address length if missing.
+ * Returns 0 on success and -1 on error
+ */
+int parse_addr(const char *str, int *family, void *addr, int *prefixlen)
+{
+	char buf[INET6_ADDRSTRLEN];
+	const char *slash = strchr(str, '/');
+	size_t len = slash ? (size_t)(slash - str) : strlen(str);
+	int max;
+
+	if (len >= sizeof buf)
+		return -1;
+	memcpy(buf, str, len);
+	buf[len] = 0;
+
+	memset(addr, 0, 16);
+	if (inet_pton(AF_INET, buf, addr) == 1) {
+		*family = AF_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, buf, addr) == 1) {
+		*family = AF_INET6;
+		max = 128;
+	} else {
+		return -1;
+	}
+	*prefixlen = max;
+	if (slash) {
+		char *end;
+		long l = strtol(slash +1, &end, 10);
+		if (*end || end == slash +1 || l < 0 || l > max)
+			return -1;
+		*prefixlen = l;
+	}
+	return 0;
+}
+
+/* Reads the integer "which" of the (option) table at "idx".
+ * Returns "def" if the table or the value is missing
+ */
+lua_Integer opt_integer(lua_State *L, int idx, const char *which,
+			lua_Integer def)
+{
+	if (!lua_istable(L, idx))
+		return def;
+	lua_getfield(L, idx, which);
+	if (!lua_isnil(L, -1)) {
+		if (!lua_isinteger(L, -1))
+			luaL_error(L, "Option '%s' must be an integer", which);
+		def = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	return def;
 }
 
-int netlink_initial(struct mnl_socket *nl, lua_State *L, int type)
+/* Reads the boolean "which" of the (option) table at "idx" */
+int opt_bool(lua_State *L, int idx, const char *which)
 {
-	struct rtgenmsg rt = { .rtgen_family = AF_INET };
+	int ret;
+
+	if (!lua_istable(L, idx))
+		return 0;
+	lua_getfield(L, idx, which);
+	ret = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return ret;
+}
+
+/* Sends a dump request of the group with sequence number "seq".
+ * The complete family header is sent, as required by strict checking,
+ * with the optional filter applied by the "request" function of the group.
+ */
+int netlink_request(struct mnl_socket *nl, const struct rtmgrp *rtmgrp,
+		unsigned int seq, const struct dump_filter *filter)
+{
+	static const struct dump_filter none;
 	char buf[MNL_SOCKET_BUFFER_SIZE];
 	struct nlmsghdr *nlh;
-	void *dst;
 
 	nlh = mnl_nlmsg_put_header(buf);
-	nlh->nlmsg_type	= type;
+	nlh->nlmsg_type	= rtmgrp->get;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
-	nlh->nlmsg_seq = 0;
-	dst = mnl_nlmsg_put_extra_header(nlh, sizeof rt);
-	memcpy(dst, &rt, sizeof rt);
+	nlh->nlmsg_seq = seq;
+	mnl_nlmsg_put_extra_header(nlh, rtmgrp->hdrlen);
+	if (rtmgrp->request)
+		rtmgrp->request(nlh, filter ? filter : &none);
 
 	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
 		return -1;
-
-	return receive(nl, L);
+	return 0;
 }
@@ -5,6 +5,10 @@
 
 #include <lua.h>
 #include <lualib.h>
+#include <lauxlib.h>
+
+#include <stddef.h>
+#include <string.h>
 
 #include <libmnl/libmnl.h>
 #include <linux/if.h>
@@ -16,42 +20,116 @@
 static int parse_attr(const struct nlattr *attr, void *data)
 {
 	struct callback_data *cbd = data;
-	lua_State *L = cbd->L;
 	int type = mnl_attr_get_type(attr);
 
 	switch (type) {
 	case IFLA_MTU:
-		push_u32_attr(L, "mtu", attr);
+		push_u32_attr(cbd, NLF_MTU, attr);
 		break;
 	case IFLA_IFNAME:
 		if (mnl_attr_validate(attr, MNL_TYPE_STRING) < 0)
 			return MNL_CB_ERROR;
-		push_string(L, "name", mnl_attr_get_str(attr));
+		push_string(cbd, NLF_NAME, mnl_attr_get_str(attr));
 		break;
 	case IFLA_ADDRESS: {
-		push_hwaddr(cbd->L, "hwaddr", attr);
+		push_hwaddr(cbd, NLF_HWADDR, attr);
 		break;
 		}
 	}
 	return MNL_CB_OK;
 }
 
+/* Adds the ethtool settings of running interfaces. They are read again
+ * only if the carrier or the operational state changed.
+ */
+static void link_ethtool(const struct nlmsghdr *nlh, struct callback_data *cbd)
+{
+	const struct nlattr *attr;
+	const char *ifname = NULL;
+	uint32_t link = cbd->ifm->ifi_flags & (IFF_RUNNING | IFF_LOWER_UP);
+
+	mnl_attr_for_each(attr, nlh, sizeof(*cbd->ifm)) {
+		switch (mnl_attr_get_type(attr)) {
+		case IFLA_IFNAME:
+			ifname = mnl_attr_get_str(attr);
+			break;
+		case IFLA_OPERSTATE:
+			if (mnl_attr_validate(attr, MNL_TYPE_U8) == 0)
+				link |= (uint32_t)mnl_attr_get_u8(attr) << 24;
+			break;
+		}
+	}
+	if (ifname)
+		ethtool_link(cbd, cbd->ifm->ifi_index, ifname, link);
+}
+
 static int link_cb(const struct nlmsghdr *nlh, struct callback_data *cbd)
 {
-	push_integer(cbd->L, "index", cbd->ifm->ifi_index);
-	push_string(cbd->L, "family", af_to_str(cbd->ifm->ifi_family));
-	push_bool(cbd->L, "running", cbd->ifm->ifi_flags & IFF_RUNNING);
-	push_bool(cbd->L, "up", cbd->ifm->ifi_flags & IFF_UP);
+	int ret;
+
+	push_integer(cbd, NLF_INDEX, cbd->ifm->ifi_index);
+	push_string(cbd, NLF_FAMILY, af_to_str(cbd->ifm->ifi_family));
+	push_bool(cbd, NLF_RUNNING, cbd->ifm->ifi_flags & IFF_RUNNING);
+	push_bool(cbd, NLF_UP, cbd->ifm->ifi_flags & IFF_UP);
+
+	ret = mnl_attr_parse(nlh, sizeof(*cbd->ifm), parse_attr, cbd);
+
+	if (nlh->nlmsg_type == RTM_DELLINK && cbd->userdata)
+		ethtool_forget(cbd->userdata, cbd->ifm->ifi_index);
 
-	if (nlh->nlmsg_type == RTM_NEWLINK &&
+	if (ret == MNL_CB_OK && cbd->fields & NLF_ETHTOOL &&
+	    nlh->nlmsg_type == RTM_NEWLINK &&
 	    cbd->ifm->ifi_flags & IFF_RUNNING)
-		netlink_ethtool(cbd->L);
+		link_ethtool(nlh, cbd);
 
-	return mnl_attr_parse(nlh, sizeof(*cbd->ifm), parse_attr, cbd);
+	return ret;
+}
+
+/* Links are identified by their interface index */
+static size_t link_lua_key(lua_State *L, int idx, unsigned char *key)
+{
+	int32_t index = luaL_checkinteger(L, idx);
+
+	memcpy(key, &index, sizeof index);
+	return sizeof index;
+}
+
+static size_t link_key(struct nlmsghdr *nlh, unsigned char *key)
+{
+	struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+
+	ifm->ifi_change = 0;
+	memcpy(key, &ifm->ifi_index, sizeof ifm->ifi_index);
+	return sizeof ifm->ifi_index;
+}
+
+/* Link dumps can not be filtered by index, the family is ignored */
+static int link_match(const struct nlmsghdr *nlh, const struct dump_filter *f)
+{
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+
+	return !f->index || ifm->ifi_index == (int)f->index;
+}
+
+static void link_bpf(struct nlbpf *p, const struct event_filter *f)
+{
+	if (f->nindex) {
+		bpf_load(p, 4, NLMSG_HDRLEN +
+				offsetof(struct ifinfomsg, ifi_index));
+		bpf_in_set(p, 4, f->index, f->nindex);
+	}
 }
 
 struct rtmgrp link_rtmgrp = {
 	"link", RTMGRP_LINK, link_cb,
-	RTM_NEWLINK, RTM_DELLINK, RTM_GETLINK
+	RTM_NEWLINK, RTM_DELLINK, RTM_GETLINK,
+	sizeof(struct ifinfomsg),
+	NLA_BIT(IFLA_MTU) | NLA_BIT(IFLA_IFNAME) | NLA_BIT(IFLA_ADDRESS) |
+	NLA_BIT(IFLA_OPERSTATE),
+	link_key, link_lua_key,
+	10,
+	NULL, link_match,
+	link_bpf,
+	NULL
 };
 LUA_RTMGRP(link_rtmgrp);
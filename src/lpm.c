@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2021 Christian Hohnstaedt
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <libmnl/libmnl.h>
+#include <linux/rtnetlink.h>
+
+#include "netlink.h"
+
+/* Longest prefix match index of the unicast routes.
+ * Every routing table and address family has its own path compressed
+ * binary trie. A node either holds routes for exactly its prefix
+ * or is an internal node with two children.
+ */
+
+struct lpm_route {
+	struct lpm_route *next;
+	uint32_t metric, oif;
+	uint8_t tos, scope, has_gateway, has_prefsrc;
+	uint8_t gateway[16], prefsrc[16];
+};
+
+struct lpm_node {
+	struct lpm_node *child[2];
+	struct lpm_route *routes;   /* sorted by metric */
+	uint8_t len;
+	uint8_t prefix[16];
+};
+
+struct lpm_table {
+	uint32_t table;
+	int family;
+	struct lpm_node *root;
+};
+
+struct lpm {
+	struct lpm_table *tables;
+	size_t count;
+};
+
+static int addr_bits(int family)
+{
+	return family == AF_INET ? 32 : 128;
+}
+
+static int bit(const uint8_t *addr, int n)
+{
+	return (addr[n >> 3] >> (7 - (n & 7))) & 1;
+}
+
+/* Returns true if the first "len" bits of "a" and "b" are equal */
+static int prefix_match(const uint8_t *a, const uint8_t *b, int len)
+{
+	int bytes = len >> 3, rest = len & 7;
+
+	if (memcmp(a, b, bytes))
+		return 0;
+	if (!rest)
+		return 1;
+	return !((a[bytes] ^ b[bytes]) & (0xff << (8 - rest)));
+}
+
+/* Returns the number of equal leading bits, at most "max" */
+static int common_len(const uint8_t *a, const uint8_t *b, int max)
+{
+	int n = 0;
+
+	while (n + 8 <= max && a[n >> 3] == b[n >> 3])
+		n += 8;
+	while (n < max && bit(a, n) == bit(b, n))
+		n++;
+	return n;
+}
+
+static struct lpm_node *node_new(const uint8_t *prefix, int len)
+{
+	struct lpm_node *n = calloc(1, sizeof *n);
+
+	if (!n)
+		return NULL;
+	n->len = len;
+	memcpy(n->prefix, prefix, (len + 7) >> 3);
+	if (len & 7)
+		n->prefix[len >> 3] &= 0xff << (8 - (len & 7));
+	return n;
+}
+
+/* Returns the node for exactly "prefix/len", creates it if needed */
+static struct lpm_node *lpm_insert(struct lpm_node **pn,
+				const uint8_t *prefix, int len)
+{
+	struct lpm_node *n, *m, *leaf;
+
+	while ((n = *pn)) {
+		int common = common_len(n->prefix, prefix,
+					n->len < len ? n->len : len);
+
+		if (common < n->len) {
+			/* Split: "m" becomes the parent of "n" */
+			m = node_new(prefix, common);
+			if (!m)
+				return NULL;
+			m->child[bit(n->prefix, common)] = n;
+			*pn = m;
+			if (common == len)
+				return m;
+			leaf = node_new(prefix, len);
+			if (!leaf)
+				return NULL;
+			m->child[bit(prefix, common)] = leaf;
+			return leaf;
+		}
+		if (n->len == len)
+			return n;
+		pn = &n->child[bit(prefix, n->len)];
+	}
+	return *pn = node_new(prefix, len);
+}
+
+/* Removes nodes without routes and less than two children */
+static struct lpm_node *lpm_prune(struct lpm_node *n)
+{
+	struct lpm_node *child;
+
+	if (n->routes || (n->child[0] && n->child[1]))
+		return n;
+	child = n->child[0] ? n->child[0] : n->child[1];
+	free(n);
+	return child;
+}
+
+static void lpm_remove(struct lpm_node **pn, const uint8_t *prefix, int len,
+			uint32_t metric, uint8_t tos)
+{
+	struct lpm_node *n = *pn;
+
+	if (!n || n->len > len || !prefix_match(n->prefix, prefix, n->len))
+		return;
+
+	if (n->len == len) {
+		struct lpm_route **pr, *r;
+
+		for (pr = &n->routes; (r = *pr); pr = &r->next) {
+			if (r->metric == metric && r->tos == tos) {
+				*pr = r->next;
+				free(r);
+				break;
+			}
+		}
+	} else {
+		lpm_remove(&n->child[bit(prefix, n->len)],
+				prefix, len, metric, tos);
+	}
+	*pn = lpm_prune(n);
+}
+
+static void lpm_free_node(struct lpm_node *n)
+{
+	struct lpm_route *r, *next;
+
+	if (!n)
+		return;
+	lpm_free_node(n->child[0]);
+	lpm_free_node(n->child[1]);
+	for (r = n->routes; r; r = next) {
+		next = r->next;
+		free(r);
+	}
+	free(n);
+}
+
+void lpm_free(struct lpm *lpm)
+{
+	size_t i;
+
+	if (!lpm)
+		return;
+	for (i = 0; i < lpm->count; i++)
+		lpm_free_node(lpm->tables[i].root);
+	free(lpm->tables);
+	free(lpm);
+}
+
+struct lpm *lpm_new(void)
+{
+	return calloc(1, sizeof(struct lpm));
+}
+
+static struct lpm_table *lpm_table(struct lpm *lpm, int family,
+				uint32_t table, int create)
+{
+	struct lpm_table *t;
+	size_t i;
+
+	for (i = 0; i < lpm->count; i++) {
+		t = lpm->tables + i;
+		if (t->table == table && t->family == family)
+			return t;
+	}
+	if (!create)
+		return NULL;
+
+	t = realloc(lpm->tables, (lpm->count + 1) * sizeof *t);
+	if (!t)
+		return NULL;
+	lpm->tables = t;
+	t += lpm->count++;
+	t->table = table;
+	t->family = family;
+	t->root = NULL;
+	return t;
+}
+
+static void copy_addr(uint8_t *dst, const struct nlattr *attr)
+{
+	size_t len = mnl_attr_get_payload_len(attr);
+
+	memcpy(dst, mnl_attr_get_payload(attr), len > 16 ? 16 : len);
+}
+
+/* Updates the index by a RTM_NEWROUTE or RTM_DELROUTE message.
+ * Returns -1 if out of memory.
+ */
+int lpm_update(struct lpm *lpm, const struct nlmsghdr *nlh)
+{
+	const struct rtmsg *rtm = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr;
+	struct lpm_route route, *r, **pr;
+	struct lpm_table *t;
+	struct lpm_node *n;
+	uint8_t dst[16] = { 0 };
+	uint32_t table = rtm->rtm_table;
+
+	if (rtm->rtm_type != RTN_UNICAST ||
+	    (rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6) ||
+	    rtm->rtm_dst_len > addr_bits(rtm->rtm_family))
+		return 0;
+
+	memset(&route, 0, sizeof route);
+	route.tos = rtm->rtm_tos;
+	route.scope = rtm->rtm_scope;
+
+	mnl_attr_for_each(attr, nlh, sizeof *rtm) {
+		switch (mnl_attr_get_type(attr)) {
+		case RTA_DST:
+			copy_addr(dst, attr);
+			break;
+		case RTA_GATEWAY:
+			copy_addr(route.gateway, attr);
+			route.has_gateway = 1;
+			break;
+		case RTA_PREFSRC:
+			copy_addr(route.prefsrc, attr);
+			route.has_prefsrc = 1;
+			break;
+		case RTA_OIF:
+			route.oif = mnl_attr_get_u32(attr);
+			break;
+		case RTA_PRIORITY:
+			route.metric = mnl_attr_get_u32(attr);
+			break;
+		case RTA_TABLE:
+			table = mnl_attr_get_u32(attr);
+			break;
+		}
+	}
+
+	if (nlh->nlmsg_type == RTM_DELROUTE) {
+		t = lpm_table(lpm, rtm->rtm_family, table, 0);
+		if (t)
+			lpm_remove(&t->root, dst, rtm->rtm_dst_len,
+					route.metric, route.tos);
+		return 0;
+	}
+
+	t = lpm_table(lpm, rtm->rtm_family, table, 1);
+	if (!t)
+		return -1;
+	n = lpm_insert(&t->root, dst, rtm->rtm_dst_len);
+	if (!n)
+		return -1;
+
+	for (pr = &n->routes; (r = *pr); pr = &r->next) {
+		if (r->metric == route.metric && r->tos == route.tos) {
+			route.next = r->next;
+			*r = route;
+			return 0;
+		}
+		if (r->metric > route.metric)
+			break;
+	}
+	r = malloc(sizeof *r);
+	if (!r)
+		return -1;
+	*r = route;
+	r->next = *pr;
+	*pr = r;
+	return 0;
+}
+
+static const struct lpm_node *lpm_match(const struct lpm_node *n,
+				const uint8_t *addr, int bits)
+{
+	const struct lpm_node *best = NULL;
+
+	while (n && prefix_match(n->prefix, addr, n->len)) {
+		if (n->routes)
+			best = n;
+		if (n->len == bits)
+			break;
+		n = n->child[bit(addr, n->len)];
+	}
+	return best;
+}
+
+static void set_addr(lua_State *L, const char *which, int family,
+			const uint8_t *addr)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	inet_ntop(family, addr, buf, sizeof buf);
+	set_string(L, which, buf);
+}
+
+/* Pushes the best route for the address string at "idx" or nil */
+static void lpm_lookup(lua_State *L, struct lpm *lpm, int idx, uint32_t table)
+{
+	const struct lpm_table *t;
+	const struct lpm_node *n;
+	const struct lpm_route *r;
+	char buf[INET6_ADDRSTRLEN];
+	uint8_t addr[16];
+	int family, len;
+	const char *str = lua_tostring(L, idx);
+
+	if (!str || parse_addr(str, &family, addr, &len) < 0)
+		luaL_error(L, "Invalid IP address '%s'", str ? str : "");
+
+	t = lpm_table(lpm, family, table, 0);
+	n = t ? lpm_match(t->root, addr, addr_bits(family)) : NULL;
+	if (!n) {
+		lua_pushnil(L);
+		return;
+	}
+	r = n->routes;
+
+	lua_createtable(L, 0, 6);
+	inet_ntop(family, n->prefix, buf, sizeof buf);
+	lua_pushliteral(L, "dst");
+	lua_pushfstring(L, "%s/%d", buf, n->len);
+	lua_rawset(L, -3);
+	if (r->has_gateway)
+		set_addr(L, "gateway", family, r->gateway);
+	if (r->has_prefsrc)
+		set_addr(L, "prefsrc", family, r->prefsrc);
+	if (r->oif)
+		set_integer(L, "index", r->oif);
+	set_integer(L, "metric", r->metric);
+	set_integer(L, "scope", r->scope);
+	set_integer(L, "table", table);
+}
+
+static struct lpm *get_lpm(lua_State *L)
+{
+	struct userdata *userdata = get_userdata(L);
+
+	if (!userdata->lpm)
+		luaL_error(L, "Route lookup is not enabled for this socket");
+	return userdata->lpm;
+}
+
+/* Returns the route with the longest matching prefix for the IP address
+ * of the optional routing table (default: main) or nil
+ */
+int nlfunc_lookup(lua_State *L)
+{
+	struct lpm *lpm = get_lpm(L);
+
+	luaL_checkstring(L, 2);
+	lpm_lookup(L, lpm, 2, luaL_optinteger(L, 3, RT_TABLE_MAIN));
+	return 1;
+}
+
+/* Like lookup() for an array of IP addresses.
+ * Returns an array with a route or false for each address.
+ */
+int nlfunc_lookup_many(lua_State *L)
+{
+	struct lpm *lpm = get_lpm(L);
+	uint32_t table = luaL_optinteger(L, 3, RT_TABLE_MAIN);
+	lua_Integer i, n;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = luaL_len(L, 2);
+	lua_settop(L, 2);
+	lua_createtable(L, n, 0);
+
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 2, i);
+		lpm_lookup(L, lpm, 4, table);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_pushboolean(L, 0);
+		}
+		lua_rawseti(L, 3, i);
+		lua_pop(L, 1);
+	}
+	return 1;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2021 Christian Hohnstaedt
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <string.h>
+
+#include <libmnl/libmnl.h>
+
+#include "netlink.h"
+
+/* Message object of "lazy" sockets: It keeps a copy of the netlink
+ * message and decodes a field only when it is accessed. Decoded fields
+ * are cached in the uservalue table.
+ */
+struct message {
+	const struct rtmgrp *rtmgrp;
+	lua_Integer stamp;
+	uint32_t decoded;
+	struct nlmsghdr nlh[];
+};
+
+static void message_decode(lua_State *L, struct message *m, uint32_t fields)
+{
+	struct callback_data cbd = {
+		.L = L,
+		.fields = fields & ~m->decoded,
+		.nl_payload = mnl_nlmsg_get_payload(m->nlh),
+	};
+
+	if (cbd.fields) {
+		/* The cache table on top is set by the callback */
+		cbd.keys = push_keys(L);
+		lua_pushvalue(L, -2);
+		m->rtmgrp->callback(m->nlh, &cbd);
+		lua_pop(L, 2);
+	}
+	m->decoded |= fields;
+}
+
+/* Pushes the table of decoded fields, creates it if needed */
+static void message_cache(lua_State *L, int idx)
+{
+	if (lua_getuservalue(L, idx) == LUA_TTABLE)
+		return;
+	lua_pop(L, 1);
+	lua_createtable(L, 0, 4);
+	lua_pushvalue(L, -1);
+	lua_setuservalue(L, idx);
+}
+
+static int message_index(lua_State *L)
+{
+	struct message *m = luaL_checkudata(L, 1, "mnl.message");
+	int field;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "mnl.fields");
+	lua_pushvalue(L, 2);
+	if (lua_rawget(L, -2) != LUA_TNUMBER)
+		return 0;
+	field = lua_tointeger(L, -1);
+
+	switch (field) {
+	case NLF_EVENT:
+		push_event(L, m->nlh->nlmsg_type);
+		return 1;
+	case NLF_STAMP:
+		lua_pushinteger(L, m->stamp);
+		return 1;
+	case NLF_NETNS:
+	case NLF_QUERY:
+		message_cache(L, 1);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+		return 1;
+	}
+	message_cache(L, 1);
+	if (!(m->decoded & NLF_BIT(field)))
+		message_decode(L, m, NLF_BIT(field));
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	return 1;
+}
+
+static int message_next(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 2);
+	if (lua_next(L, 1))
+		return 2;
+	lua_pushnil(L);
+	return 1;
+}
+
+/* Decodes all fields for: for k, v in pairs(message) do ... end */
+static int message_pairs(lua_State *L)
+{
+	struct message *m = luaL_checkudata(L, 1, "mnl.message");
+
+	lua_pushcfunction(L, message_next);
+	message_cache(L, 1);
+	message_decode(L, m, NLF_ALL);
+	lua_pushliteral(L, "event");
+	push_event(L, m->nlh->nlmsg_type);
+	lua_rawset(L, -3);
+	set_integer(L, "stamp", m->stamp);
+	lua_pushnil(L);
+	return 3;
+}
+
+/* Returns the bitmask of the field names in the array at "idx" */
+uint32_t fields_from_list(lua_State *L, int idx)
+{
+	uint32_t fields = 0;
+	lua_Integer i, n = luaL_len(L, idx);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "mnl.fields");
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, idx, i);
+		if (lua_rawget(L, -2) != LUA_TNUMBER) {
+			lua_rawgeti(L, idx, i);
+			luaL_error(L, "Unknown field '%s'",
+					luaL_tolstring(L, -1, NULL));
+		}
+		/* "event", "stamp", "netns" and "query" are always set */
+		if (lua_tointeger(L, -1) < NLF_MAX)
+			fields |= NLF_BIT(lua_tointeger(L, -1));
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return fields;
+}
+
+/* Pushes a message object. Returns 0 and pushes nothing,
+ * if the callback of the group rejects the message.
+ * The ethtool settings are read right away by the socket, from its
+ * cache and in its namespace, all other fields only when accessed.
+ */
+int message_new(struct userdata *userdata, const struct rtmgrp *rtmgrp,
+		const struct nlmsghdr *nlh)
+{
+	lua_State *L = userdata->L;
+	struct callback_data cbd = {
+		.L = L,
+		/* ethtool settings are read in the socket's namespace only */
+		.fields = userdata->nsid < 0 ? NLF_ETHTOOL : 0,
+		.nl_payload = mnl_nlmsg_get_payload(nlh),
+		.userdata = userdata,
+	};
+	struct message *m;
+	int ret;
+
+	m = lua_newuserdata(L, sizeof *m + nlh->nlmsg_len);
+	m->rtmgrp = rtmgrp;
+	m->stamp = timestamp();
+	m->decoded = NLF_ETHTOOL;
+	memcpy(m->nlh, nlh, nlh->nlmsg_len);
+	luaL_setmetatable(L, "mnl.message");
+
+	if (cbd.fields) {
+		message_cache(L, lua_gettop(L));
+		cbd.keys = push_keys(L);
+		lua_pushvalue(L, -2);
+		ret = m->rtmgrp->callback(m->nlh, &cbd);
+		lua_pop(L, 3);
+	} else {
+		/* Validate only, no fields are set without a table */
+		ret = rtmgrp->callback(nlh, &cbd);
+	}
+	if (ret != MNL_CB_OK) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	return 1;
+}
+
+/* Sets the field "which" of the message below the value on top of
+ * the stack in its cache and pops the value
+ */
+void message_set(lua_State *L, const char *which)
+{
+	message_cache(L, lua_absindex(L, -2));
+	lua_insert(L, -2);
+	lua_setfield(L, -2, which);
+	lua_pop(L, 1);
+}
+
+/* Registers the "mnl.message" metatable */
+void message_init(lua_State *L)
+{
+	if (luaL_newmetatable(L, "mnl.message")) {
+		lua_pushliteral(L, "__index");
+		lua_pushcfunction(L, message_index);
+		lua_rawset(L, -3);
+		lua_pushliteral(L, "__pairs");
+		lua_pushcfunction(L, message_pairs);
+		lua_rawset(L, -3);
+	}
+	lua_pop(L, 1);
+}
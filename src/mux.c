@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2021 Christian Hohnstaedt
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+
+#include "netlink.h"
+
+/* Multiplexer of netlink sockets, e.g. one per network namespace.
+ * The event file descriptors of the sockets are watched by one epoll
+ * descriptor. The uservalue holds the sockets by file descriptor and
+ * the set of sockets to read by the next event() call: the ready ones
+ * and those with messages left by the budget.
+ */
+struct mux {
+	int epfd;
+};
+
+/* Ready sockets taken by one epoll_wait() */
+#define NL_MUX_EVENTS 64
+
+#define MUX_SOCKETS 1
+#define MUX_PENDING 2
+
+static struct mux *get_mux(lua_State *L)
+{
+	struct mux *mux = luaL_checkudata(L, 1, "mnl.mux");
+
+	if (mux->epfd < 0)
+		luaL_error(L, "Multiplexer is closed");
+	return mux;
+}
+
+/* Pushes the table "which" of the uservalue */
+static void push_table(lua_State *L, int which)
+{
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, which);
+	lua_remove(L, -2);
+}
+
+/* Adds the netlink socket to the multiplexer */
+static int mux_add(lua_State *L)
+{
+	struct mux *mux = get_mux(L);
+	struct userdata *userdata = luaL_checkudata(L, 2, "mnl.netlink");
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	ev.data.fd = event_fd(userdata);
+	if (epoll_ctl(mux->epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0)
+		return luaL_error(L, "epoll_ctl(): %s", strerror(errno));
+
+	push_table(L, MUX_SOCKETS);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, ev.data.fd);
+	/* Messages may already be waiting in the receive buffers */
+	push_table(L, MUX_PENDING);
+	lua_pushvalue(L, 2);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, -3);
+	return 0;
+}
+
+/* Removes the netlink socket from the multiplexer */
+static int mux_remove(lua_State *L)
+{
+	struct mux *mux = get_mux(L);
+	struct userdata *userdata = luaL_checkudata(L, 2, "mnl.netlink");
+	int fd = event_fd(userdata);
+
+	push_table(L, MUX_SOCKETS);
+	lua_rawgeti(L, -1, fd);
+	if (lua_rawequal(L, -1, 2)) {
+		epoll_ctl(mux->epfd, EPOLL_CTL_DEL, fd, NULL);
+		lua_pushnil(L);
+		lua_rawseti(L, -3, fd);
+	}
+	push_table(L, MUX_PENDING);
+	lua_pushvalue(L, 2);
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+	return 0;
+}
+
+/* Returns the epoll file descriptor to be used in poll or select */
+static int mux_fd(lua_State *L)
+{
+	struct mux *mux = get_mux(L);
+
+	lua_pushinteger(L, mux->epfd);
+	return 1;
+}
+
+/* Returns 1 if sockets are left to read by event() */
+static int mux_pending(lua_State *L)
+{
+	int pending;
+
+	push_table(L, MUX_PENDING);
+	lua_pushnil(L);
+	pending = lua_next(L, -2);
+	lua_pop(L, pending ? 3 : 1);
+	return pending;
+}
+
+/* Waits for events of any socket like poll() of a socket */
+static int mux_poll(lua_State *L)
+{
+	struct mux *mux = get_mux(L);
+	int tout = -1, ret;
+	struct pollfd pfd = {
+		.fd = mux->epfd,
+		.events = POLLIN,
+	};
+
+	if (lua_isinteger(L, 2))
+		tout = lua_tointeger(L, 2);
+	if (mux_pending(L)) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	ret = poll(&pfd, 1, tout);
+	if (ret == -1)
+		return luaL_error(L, "poll(): %s\n", strerror(errno));
+	lua_pushboolean(L, ret);
+	return 1;
+}
+
+/* Calls event() of the ready sockets with the optional budget table,
+ * which applies to each socket. Returns the entries of all sockets in
+ * one array, true if any socket buffer overflowed, the total number of
+ * coalesced events and true if more events are pending.
+ * The entries have the "netns" of their socket.
+ */
+static int mux_event(lua_State *L)
+{
+	struct mux *mux = get_mux(L);
+	struct epoll_event ev[NL_MUX_EVENTS];
+	lua_Integer n = 0, merged = 0, i, len;
+	int nev, j, overflow = 0, more = 0;
+
+	lua_settop(L, 2);
+	push_table(L, MUX_SOCKETS);                  /* 3 */
+	push_table(L, MUX_PENDING);                  /* 4 */
+	lua_newtable(L);                             /* 5 */
+
+	nev = epoll_wait(mux->epfd, ev, NL_MUX_EVENTS, 0);
+	if (nev < 0 && errno != EINTR)
+		return luaL_error(L, "epoll_wait(): %s", strerror(errno));
+	for (j = 0; j < nev; j++) {
+		if (lua_rawgeti(L, 3, ev[j].data.fd) == LUA_TNIL) {
+			lua_pop(L, 1);
+			continue;
+		}
+		lua_pushboolean(L, 1);
+		lua_rawset(L, 4);
+	}
+	/* The rest stays ready for the next call */
+	if (nev == NL_MUX_EVENTS)
+		more = 1;
+
+	lua_pushnil(L);
+	while (lua_next(L, 4)) {
+		lua_pop(L, 1);                       /* socket at 6 */
+		lua_getfield(L, 6, "event");
+		lua_pushvalue(L, 6);
+		lua_pushvalue(L, 2);
+		lua_call(L, 2, 4);                   /* 7 .. 10 */
+
+		len = luaL_len(L, 7);
+		for (i = 1; i <= len; i++) {
+			lua_rawgeti(L, 7, i);
+			lua_rawseti(L, 5, ++n);
+		}
+		overflow |= lua_toboolean(L, 8);
+		merged += lua_tointeger(L, 9);
+		if (lua_toboolean(L, 10)) {
+			more = 1;
+		} else {
+			lua_pushvalue(L, 6);
+			lua_pushnil(L);
+			lua_rawset(L, 4);
+		}
+		lua_settop(L, 6);
+	}
+	lua_pushboolean(L, overflow);
+	lua_pushinteger(L, merged);
+	lua_pushboolean(L, more);
+	return 4;
+}
+
+/* Like query_parallel() of a socket for all sockets of the multiplexer.
+ * The dumps of all sockets and groups share one pool of worker threads.
+ */
+static int mux_query(lua_State *L)
+{
+	struct userdata **users;
+	struct dump_filter filter;
+	size_t n = 0;
+	int groups = 0, filtered, threads;
+
+	get_mux(L);
+	threads = dump_thread_count(L, 4);
+	filtered = filter_from_table(L, 3, &filter);
+	if (lua_istable(L, 2))
+		groups = groups_from_set(L, 2);
+	lua_settop(L, 3);
+
+	push_table(L, MUX_SOCKETS);                  /* 4 */
+	lua_pushnil(L);
+	while (lua_next(L, 4)) {
+		lua_pop(L, 1);
+		n++;
+	}
+	users = lua_newuserdata(L, (n ? n : 1) * sizeof *users);
+	n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 4)) {
+		struct userdata *userdata = lua_touserdata(L, -1);
+
+		check_idle(userdata, L);
+		reset_call(userdata, L);
+		if (lua_istable(L, 2)) {
+			uint32_t *fields = userdata->fields + RTMGRP_COUNT;
+
+			if (fields_from_set(L, 2, fields))
+				userdata->projection = fields;
+		}
+		users[n++] = userdata;
+		lua_pop(L, 1);
+	}
+
+	lua_newtable(L);
+	dump_threads(L, lua_gettop(L), users, n, groups,
+			filtered ? &filter : NULL, threads);
+	return 1;
+}
+
+static int mux_gc(lua_State *L)
+{
+	struct mux *mux = lua_touserdata(L, 1);
+
+	if (mux->epfd >= 0)
+		close(mux->epfd);
+	mux->epfd = -1;
+	return 0;
+}
+
+/* Creates a multiplexer without sockets */
+int netlink_mux(lua_State *L)
+{
+	struct mux *mux = lua_newuserdata(L, sizeof *mux);
+
+	mux->epfd = -1;
+	luaL_setmetatable(L, "mnl.mux");
+	lua_createtable(L, 2, 0);
+	lua_newtable(L);
+	lua_rawseti(L, -2, MUX_SOCKETS);
+	lua_newtable(L);
+	lua_rawseti(L, -2, MUX_PENDING);
+	lua_setuservalue(L, -2);
+
+	mux->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (mux->epfd < 0)
+		return luaL_error(L, "epoll_create1(): %s", strerror(errno));
+	return 1;
+}
+
+static const struct luaL_Reg mux_functions[] = {
+	{ "add", mux_add },
+	{ "remove", mux_remove },
+	{ "fd", mux_fd },
+	{ "poll", mux_poll },
+	{ "event", mux_event },
+	{ "query", mux_query },
+	{ NULL, NULL }
+};
+
+/* Registers the "mnl.mux" metatable */
+void mux_init(lua_State *L)
+{
+	if (luaL_newmetatable(L, "mnl.mux")) {
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, mux_gc);
+		lua_rawset(L, -3);
+		lua_pushliteral(L, "__index");
+		luaL_newlib(L, mux_functions);
+		lua_rawset(L, -3);
+	}
+	lua_pop(L, 1);
+}
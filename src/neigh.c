@@ -5,12 +5,81 @@
 
 #include <lua.h>
 #include <lualib.h>
+#include <lauxlib.h>
+
+#include <stddef.h>
+#include <string.h>
 
 #include <libmnl/libmnl.h>
 #include <linux/rtnetlink.h>
 
 #include "netlink.h"
 
+static const struct {
+	const char *name;
+	int state;
+} neigh_states[] = {
+	{ "reachable", NUD_REACHABLE },
+	{ "stale", NUD_STALE },
+	{ "probe", NUD_PROBE },
+	{ "failed", NUD_FAILED },
+	{ "permanent", NUD_PERMANENT },
+};
+
+/* Returns the name of the NUD_... state or NULL */
+static const char *neigh_state_name(int state)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof neigh_states / sizeof *neigh_states; i++) {
+		if (neigh_states[i].state == state)
+			return neigh_states[i].name;
+	}
+	return NULL;
+}
+
+/* Returns the NUD_... state of the name or 0 */
+static int neigh_state_value(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof neigh_states / sizeof *neigh_states; i++) {
+		if (!strcmp(neigh_states[i].name, name))
+			return neigh_states[i].state;
+	}
+	return 0;
+}
+
+static int neigh_state(lua_State *L, const char *name)
+{
+	int state = neigh_state_value(name);
+
+	if (!state)
+		return luaL_error(L, "Invalid neighbour state '%s'", name);
+	return state;
+}
+
+/* Returns the NUD_... bits of the state name or array of names at "idx" */
+int neigh_state_bits(lua_State *L, int idx)
+{
+	lua_Integer i, n;
+	int bits = 0;
+
+	if (lua_type(L, idx) == LUA_TSTRING)
+		return neigh_state(L, lua_tostring(L, idx));
+	luaL_checktype(L, idx, LUA_TTABLE);
+
+	n = luaL_len(L, idx);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, idx, i);
+		if (lua_type(L, -1) != LUA_TSTRING)
+			luaL_error(L, "Neighbour states must be strings");
+		bits |= neigh_state(L, lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+	return bits;
+}
+
 static int parse_attr(const struct nlattr *attr, void *data)
 {
 	struct callback_data *cbd = data;
@@ -18,40 +87,194 @@ static int parse_attr(const struct nlattr *attr, void *data)
 
 	switch (type) {
 	case NDA_DST:
-		push_ip(cbd->L, "ip", cbd->ndm->ndm_family, attr);
+		push_ip(cbd, NLF_IP, cbd->ndm->ndm_family, attr);
 		break;
 	case NDA_LLADDR:
-		push_hwaddr(cbd->L, "hwaddr", attr);
+		push_hwaddr(cbd, NLF_HWADDR, attr);
 		break;
 	case NDA_PROBES:
 		if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
 			return MNL_CB_ERROR;
-		push_integer(cbd->L, "probes", mnl_attr_get_u32(attr));
+		push_integer(cbd, NLF_PROBES, mnl_attr_get_u32(attr));
 	}
 	return MNL_CB_OK;
 }
 
 static int neigh_cb(const struct nlmsghdr *nlh, struct callback_data *cbd)
 {
-	const char *nud_state;
+	const char *nud_state = neigh_state_name(cbd->ndm->ndm_state);
 
-	switch (cbd->ndm->ndm_state) {
-	case NUD_REACHABLE: nud_state = "reachable"; break;
-	case NUD_STALE:     nud_state = "stale"; break;
-	case NUD_PROBE:     nud_state = "probe"; break;
-	case NUD_FAILED:    nud_state = "failed"; break;
-	case NUD_PERMANENT: nud_state = "permanent"; break;
-	default:
+	if (!nud_state)
 		return MNL_CB_STOP;
-	}
-	push_integer(cbd->L, "index", cbd->ndm->ndm_ifindex);
-	push_string(cbd->L, "state", nud_state);
+	push_integer(cbd, NLF_INDEX, cbd->ndm->ndm_ifindex);
+	push_string(cbd, NLF_STATE, nud_state);
 
 	return mnl_attr_parse(nlh, sizeof(*cbd->ndm), parse_attr, cbd);
 }
 
+/* Neighbours are identified by interface and IP address */
+struct neigh_key {
+	uint32_t ifindex;
+	uint8_t family, pad[3];
+	uint8_t dst[16];
+};
+
+static size_t neigh_key(struct nlmsghdr *nlh, unsigned char *key)
+{
+	const struct ndmsg *ndm = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr;
+	struct neigh_key k;
+
+	memset(&k, 0, sizeof k);
+	k.ifindex = ndm->ndm_ifindex;
+	k.family = ndm->ndm_family;
+
+	mnl_attr_for_each(attr, nlh, sizeof *ndm) {
+		size_t len = mnl_attr_get_payload_len(attr);
+
+		if (mnl_attr_get_type(attr) == NDA_DST && len <= sizeof k.dst)
+			memcpy(k.dst, mnl_attr_get_payload(attr), len);
+	}
+	memcpy(key, &k, sizeof k);
+	return sizeof k;
+}
+
+/* Arguments: interface index, IP address */
+static size_t neigh_lua_key(lua_State *L, int idx, unsigned char *key)
+{
+	struct neigh_key k;
+	int family, prefixlen;
+
+	memset(&k, 0, sizeof k);
+	k.ifindex = luaL_checkinteger(L, idx);
+	if (parse_addr(luaL_checkstring(L, idx +1), &family, k.dst,
+			&prefixlen) < 0)
+		return luaL_argerror(L, idx +1, "Invalid address");
+	k.family = family;
+	memcpy(key, &k, sizeof k);
+	return sizeof k;
+}
+
+/* The kernel filters neighbour dumps by family and NDA_IFINDEX,
+ * but rejects a state in the header
+ */
+static void neigh_request(struct nlmsghdr *nlh, const struct dump_filter *f)
+{
+	struct ndmsg *ndm = mnl_nlmsg_get_payload(nlh);
+
+	ndm->ndm_family = f->family;
+	if (f->index)
+		mnl_attr_put_u32(nlh, NDA_IFINDEX, f->index);
+}
+
+static int neigh_match(const struct nlmsghdr *nlh, const struct dump_filter *f)
+{
+	const struct ndmsg *ndm = mnl_nlmsg_get_payload(nlh);
+
+	return (!f->family || ndm->ndm_family == f->family) &&
+		(!f->index || ndm->ndm_ifindex == (int)f->index) &&
+		(!f->state || ndm->ndm_state & f->state);
+}
+
+static void neigh_bpf(struct nlbpf *p, const struct event_filter *f)
+{
+	if (f->nindex) {
+		bpf_load(p, 4, NLMSG_HDRLEN +
+				offsetof(struct ndmsg, ndm_ifindex));
+		bpf_in_set(p, 4, f->index, f->nindex);
+	}
+	if (f->state) {
+		bpf_load(p, 2, NLMSG_HDRLEN + offsetof(struct ndmsg, ndm_state));
+		bpf_any_bit(p, f->state);
+	}
+}
+
+/* Returns the value of the hex digit "c" or -1 */
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Parses "hwaddr" like "00:11:22:33:44:55" into "hwaddr" of "size" bytes.
+ * Returns the number of bytes or 0 if it is invalid.
+ */
+static int parse_hwaddr(const char *str, uint8_t *hwaddr, int size)
+{
+	int n = 0, hi, lo;
+
+	for (;;) {
+		hi = hex_digit(str[0]);
+		lo = hi < 0 ? -1 : hex_digit(str[1]);
+		if (lo < 0 || n == size)
+			return 0;
+		hwaddr[n++] = hi << 4 | lo;
+		str += 2;
+		if (!*str)
+			return n;
+		if (*str++ != ':')
+			return 0;
+	}
+}
+
+/* Builds the neighbour "ip" of the interface "index" with the optional
+ * "hwaddr" like "00:11:22:33:44:55" and "state" (default "permanent")
+ */
+static const char *neigh_build(struct nlmsghdr *nlh, lua_State *L, int idx)
+{
+	struct ndmsg *ndm = mnl_nlmsg_get_payload(nlh);
+	int family = 0, len, state;
+	lua_Integer value;
+	const char *str;
+
+	if (write_integer(L, idx, "index", &value) <= 0 ||
+	    value <= 0 || value > INT32_MAX)
+		return "Invalid index";
+	ndm->ndm_ifindex = value;
+	if (write_addr(nlh, L, idx, "ip", NDA_DST, &family, &len) <= 0)
+		return "Invalid address";
+	ndm->ndm_family = family;
+
+	lua_getfield(L, idx, "hwaddr");
+	str = lua_tostring(L, -1);
+	if (str) {
+		uint8_t hwaddr[32];
+		int n = parse_hwaddr(str, hwaddr, sizeof hwaddr);
+
+		if (!n) {
+			lua_pop(L, 1);
+			return "Invalid hwaddr";
+		}
+		mnl_attr_put(nlh, NDA_LLADDR, n, hwaddr);
+	}
+	lua_pop(L, 1);
+
+	if (nlh->nlmsg_type == RTM_DELNEIGH)
+		return NULL;
+	lua_getfield(L, idx, "state");
+	str = lua_tostring(L, -1);
+	state = str ? neigh_state_value(str) : NUD_PERMANENT;
+	lua_pop(L, 1);
+	if (!state)
+		return "Invalid state";
+	ndm->ndm_state = state;
+	return NULL;
+}
+
 struct rtmgrp neigh_rtmgrp = {
 	"neigh", RTMGRP_NEIGH, neigh_cb,
-	RTM_NEWNEIGH, RTM_DELNEIGH, RTM_GETNEIGH
+	RTM_NEWNEIGH, RTM_DELNEIGH, RTM_GETNEIGH,
+	sizeof(struct ndmsg),
+	NLA_BIT(NDA_DST) | NLA_BIT(NDA_LLADDR) | NLA_BIT(NDA_PROBES),
+	neigh_key, neigh_lua_key,
+	5,
+	neigh_request, neigh_match,
+	neigh_bpf,
+	neigh_build
 };
 LUA_RTMGRP(neigh_rtmgrp);
@@ -3,33 +3,37 @@
  * SPDX-License-Identifier: MIT
  */
 
+#define _GNU_SOURCE /* recvmmsg() */
+
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <time.h>
 #include <poll.h>
+#include <unistd.h>
 
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 
 #include <libmnl/libmnl.h>
 #include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "netlink.h"
 
-struct userdata {
-	struct mnl_socket *nl;
-	int groups;
-};
-
 /* This was added in Linux 5.15, but musl's headers don't have it yet */
 #ifndef AF_MCTP
 #define AF_MCTP 45
 #endif
 
+/* Added in Linux 4.2 */
+#ifndef NETLINK_LISTEN_ALL_NSID
+#define NETLINK_LISTEN_ALL_NSID 8
+#endif
+
 const char *af_to_str(int af)
 {
   switch (af) {
@@ -130,86 +134,415 @@ const char *af_to_str(int af)
   }
 }
 
-/* Callback function for each netlink message
- * Iterates over all "struct rtmgrp" and checks whether
- * the "nlmsg_type" is their "new" or "del" type and calls
- * the registered callback of the group.
- * The "stamp" and "event" values are set here for all
+/* Groups by their "new" and "del" message types, see rtmgrp_init() */
+static const struct rtmgrp *rtmgrp_types[NL_TYPE_MAX];
+
+/* Returns the group for a "new" or "del" message type */
+const struct rtmgrp *rtmgrp_by_type(int type)
+{
+	struct rtmgrp *rtmgrp;
+
+	if (type >= 0 && type < NL_TYPE_MAX)
+		return rtmgrp_types[type];
+
+	for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp; rtmgrp++) {
+		if (type == rtmgrp->new || type == rtmgrp->del)
+			return rtmgrp;
+	}
+	return NULL;
+}
+
+/* Pushes the event name like "newlink" of the message type */
+void push_event(lua_State *L, int type)
+{
+	lua_rawgetp(L, LUA_REGISTRYINDEX, rtmgrp_types);
+	lua_rawgeti(L, -1, type);
+	lua_remove(L, -2);
+}
+
+/* Fills the type dispatch table and stores the event names of all
+ * message types in the registry, so they are not built per message
+ */
+static void rtmgrp_init(lua_State *L)
+{
+	struct rtmgrp *rtmgrp;
+
+	lua_createtable(L, 0, 2 * RTMGRP_COUNT);
+	for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp; rtmgrp++) {
+		if (rtmgrp->new < NL_TYPE_MAX)
+			rtmgrp_types[rtmgrp->new] = rtmgrp;
+		if (rtmgrp->del < NL_TYPE_MAX)
+			rtmgrp_types[rtmgrp->del] = rtmgrp;
+
+		lua_pushfstring(L, "new%s", rtmgrp->name);
+		lua_rawseti(L, -2, rtmgrp->new);
+		lua_pushfstring(L, "del%s", rtmgrp->name);
+		lua_rawseti(L, -2, rtmgrp->del);
+	}
+	lua_rawsetp(L, LUA_REGISTRYINDEX, rtmgrp_types);
+}
+
+/* Returns the group named by the string argument at "idx" */
+const struct rtmgrp *rtmgrp_by_name(lua_State *L, int idx)
+{
+	const char *name = luaL_checkstring(L, idx);
+	struct rtmgrp *rtmgrp;
+
+	for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp; rtmgrp++) {
+		if (!strcmp(name, rtmgrp->name))
+			return rtmgrp;
+	}
+	luaL_error(L, "Unknown netlink group '%s'", name);
+	return NULL;
+}
+
+/* Pushes the namespace of the current datagram: its id on sockets
+ * with "all_nsid" or the "netns" option of the socket. Returns 0 and
+ * pushes nothing if the socket is not bound to another namespace.
  */
-static int data_cb(const struct nlmsghdr *nlh, void *Ldata)
+int push_netns(struct userdata *userdata, lua_State *L)
 {
-	lua_State *L = Ldata;
+	if (userdata->nsid >= 0)
+		lua_pushinteger(L, userdata->nsid);
+	else if (userdata->netns_tag != LUA_NOREF)
+		lua_rawgeti(L, LUA_REGISTRYINDEX, userdata->netns_tag);
+	else
+		return 0;
+	return 1;
+}
+
+/* Converts the message to a lua table by calling the registered callback
+ * of the group. The "stamp", "event", "netns" and "query" values are set
+ * here for all. Returns 1 if the table was pushed, 0 if the callback
+ * rejected it.
+ */
+int push_message(struct userdata *userdata, const struct rtmgrp *rtmgrp,
+			const struct nlmsghdr *nlh)
+{
+	lua_State *L = userdata->L;
 	struct callback_data cbd = {
 		.L = L,
+		.fields = userdata->projection ?
+			userdata->projection[rtmgrp_index(rtmgrp)] : NLF_ALL,
 		.nl_payload = mnl_nlmsg_get_payload(nlh),
+		.userdata = userdata,
 	};
-	int ret = MNL_CB_STOP, top;
-	struct timespec tp;
-	struct rtmgrp *rtmgrp;
+	int ret, top, nrec = rtmgrp->nfields;
 
-	top = lua_gettop(L);
-	lua_newtable(L);
+	if (userdata->lazy) {
+		if (!message_new(userdata, rtmgrp, nlh))
+			return 0;
+		if (push_netns(userdata, L))
+			message_set(L, "netns");
+		if (userdata->query) {
+			lua_pushinteger(L, userdata->query);
+			message_set(L, "query");
+		}
+		return 1;
+	}
 
-	clock_gettime(CLOCK_MONOTONIC, &tp);
+	/* ethtool settings are read in the socket's namespace only */
+	if (userdata->nsid >= 0)
+		cbd.fields &= ~NLF_ETHTOOL;
 
-	push_integer(L, "stamp", tp.tv_nsec /(1000*1000) + tp.tv_sec *1000);
+	top = lua_gettop(L);
+	cbd.keys = push_keys(L);
+	if (__builtin_popcount(cbd.fields) < nrec)
+		nrec = __builtin_popcount(cbd.fields);
+	lua_createtable(L, 0, nrec + 4);
 
-	for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp; rtmgrp++) {
-		const char *eventtype;
+	lua_rawgeti(L, cbd.keys, NLF_STAMP +1);
+	lua_pushinteger(L, timestamp());
+	lua_rawset(L, -3);
 
-		if (nlh->nlmsg_type == rtmgrp->new)
-			eventtype = "new";
-		else if (nlh->nlmsg_type == rtmgrp->del)
-			eventtype = "del";
-		else
-			continue;
+	lua_rawgeti(L, cbd.keys, NLF_EVENT +1);
+	push_event(L, nlh->nlmsg_type);
+	lua_rawset(L, -3);
 
-		lua_pushliteral(L, "event");
-		lua_pushfstring(L, "%s%s", eventtype, rtmgrp->name);
+	lua_rawgeti(L, cbd.keys, NLF_NETNS +1);
+	if (push_netns(userdata, L))
 		lua_rawset(L, -3);
+	else
+		lua_pop(L, 1);
 
-		ret = rtmgrp->callback(nlh, &cbd);
-		break;
+	if (userdata->query) {
+		lua_rawgeti(L, cbd.keys, NLF_QUERY +1);
+		lua_pushinteger(L, userdata->query);
+		lua_rawset(L, -3);
 	}
-	if (ret != MNL_CB_OK)
+
+	ret = rtmgrp->callback(nlh, &cbd);
+	if (ret != MNL_CB_OK) {
 		lua_settop(L, top);
-	else
-		lua_seti(L, 2, luaL_len(L, 2) +1);
+		return 0;
+	}
+	lua_remove(L, cbd.keys);
+	return 1;
+}
 
-	return MNL_CB_OK;
+/* Creates the result array at stack index 2 */
+void push_result(struct userdata *userdata, lua_State *L)
+{
+	lua_settop(L, 1);
+	lua_newtable(L);
+	userdata->result = 2;
+	userdata->nresults = 0;
+}
+
+/* Decodes the message and emits it by emit_entry() */
+void emit_message(struct userdata *userdata, const struct rtmgrp *rtmgrp,
+			const struct nlmsghdr *nlh)
+{
+	if (push_message(userdata, rtmgrp, nlh))
+		emit_entry(userdata);
 }
 
-/* Receive a netlink message in non-blocking mode.
- * It stops on "EBUSY" and "EAGAIN" or if the callback returns MNL_CB_STOP.
- * In case of any other I/O error a lua error is thrown
+/* Calls the handler registered for the event of the entry on top
+ * of the stack or appends it to the result array.
+ * The socket is "busy" while the handler runs, see check_idle().
  */
-int receive(struct mnl_socket *nl, lua_State *L)
+void emit_entry(struct userdata *userdata)
 {
-	char buf[MNL_SOCKET_BUFFER_SIZE];
+	lua_State *L = userdata->L;
 	int ret;
 
-	do {
-		ret = mnl_socket_recvfrom(nl, buf, sizeof buf);
-		if (ret == -1)
-			break;
-		ret = mnl_cb_run(buf, ret, 0, 0, data_cb, L);
-		if (ret == -1) {
-			if  (errno == EBUSY || errno == EAGAIN)
-				ret = MNL_CB_STOP;
-			else
-				return luaL_error(L, "mnl_cb_run(): %s",
-							strerror(errno));
+	if (userdata->handlers != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, userdata->handlers);
+		lua_getfield(L, -2, "event");
+		lua_rawget(L, -2);
+		if (lua_isfunction(L, -1)) {
+			lua_insert(L, -3);
+			lua_pop(L, 1);
+			userdata->busy = 1;
+			ret = lua_pcall(L, 1, 0, 0);
+			userdata->busy = 0;
+			if (ret != LUA_OK)
+				lua_error(L);
+			return;
 		}
-	} while (ret == MNL_CB_OK);
+		lua_pop(L, 2);
+	}
+	lua_rawseti(L, userdata->result, ++userdata->nresults);
+}
+
+/* Updates the route index by RTM_NEWROUTE and RTM_DELROUTE */
+void index_update(struct userdata *userdata, const struct nlmsghdr *nlh)
+{
+	if (!userdata->lpm || (nlh->nlmsg_type != RTM_NEWROUTE &&
+				nlh->nlmsg_type != RTM_DELROUTE))
+		return;
+	if (lpm_update(userdata->lpm, nlh) < 0)
+		luaL_error(userdata->L, "Out of memory for route index");
+}
+
+/* Looks up the "struct rtmgrp" whose "new" or "del" type matches
+ * the "nlmsg_type" and updates the state copy and indexes.
+ * Returns the group or NULL if the message shall not be emitted.
+ */
+const struct rtmgrp *update_message(struct userdata *userdata,
+			const struct nlmsghdr *nlh)
+{
+	const struct rtmgrp *rtmgrp = rtmgrp_by_type(nlh->nlmsg_type);
+
+	if (!rtmgrp)
+		return NULL;
+	if (userdata->filter && rtmgrp->match &&
+	    !rtmgrp->match(nlh, userdata->filter))
+		return NULL;
+	index_update(userdata, nlh);
+	if (userdata->state && !state_update(userdata, rtmgrp, nlh))
+		return NULL;
+	return rtmgrp;
+}
 
+/* Callback function for each netlink message */
+int data_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct userdata *userdata = data;
+	const struct rtmgrp *rtmgrp = update_message(userdata, nlh);
+
+	if (rtmgrp)
+		emit_message(userdata, rtmgrp, nlh);
 	return MNL_CB_OK;
 }
 
+#define NL_CONTROL_SIZE CMSG_SPACE(sizeof(int))
+
+/* Allocates the receive buffer set of "nbufs" buffers with "bufsize" bytes
+ * and prepares the mmsghdr array for recvmmsg(). Returns -1 on failure.
+ */
+static int alloc_buffers(struct userdata *userdata, unsigned int nbufs,
+			size_t bufsize)
+{
+	unsigned int i;
+	char *mem;
+
+	mem = malloc(nbufs * (sizeof *userdata->msgs + sizeof *userdata->iov +
+			NL_CONTROL_SIZE + sizeof *userdata->addr +
+			sizeof *userdata->nsids + bufsize));
+	if (!mem)
+		return -1;
+
+	userdata->nbufs = nbufs;
+	userdata->bufsize = bufsize;
+	userdata->msgs = (struct mmsghdr *)mem;
+	userdata->iov = (struct iovec *)(userdata->msgs + nbufs);
+	/* The control data first, it is aligned like the iovecs */
+	userdata->control = (char *)(userdata->iov + nbufs);
+	userdata->addr = (struct sockaddr_nl *)(userdata->control +
+			nbufs * NL_CONTROL_SIZE);
+	userdata->nsids = (int *)(userdata->addr + nbufs);
+	userdata->buf = (char *)(userdata->nsids + nbufs);
+
+	memset(userdata->msgs, 0, nbufs * sizeof *userdata->msgs);
+	for (i = 0; i < nbufs; i++) {
+		struct msghdr *hdr = &userdata->msgs[i].msg_hdr;
+
+		userdata->iov[i].iov_base = userdata->buf + i * bufsize;
+		userdata->iov[i].iov_len = bufsize;
+		hdr->msg_iov = &userdata->iov[i];
+		hdr->msg_iovlen = 1;
+		hdr->msg_name = &userdata->addr[i];
+		hdr->msg_control = userdata->control + i * NL_CONTROL_SIZE;
+	}
+	return 0;
+}
+
+/* Callback of the event socket: Holds back the message for coalescing
+ * or emits it. The message is in a receive buffer and may be modified.
+ */
+static int event_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct userdata *userdata = data;
+
+	if (userdata->coalesce_window >= 0 &&
+	    coalesce_add(userdata, (struct nlmsghdr *)nlh))
+		return MNL_CB_OK;
+	return data_cb(nlh, data);
+}
+
+/* Returns 1 if the budget of the event() call is used up */
+static int budget_exhausted(struct userdata *userdata)
+{
+	if (userdata->budget && ++userdata->processed >= userdata->budget)
+		return 1;
+	return userdata->deadline && timestamp_us() >= userdata->deadline;
+}
+
+/* Processes the received datagrams, starting with the message at
+ * "offset" of the "next" one. Replies to the socket itself belong to
+ * the dumps of query_start(). Returns 1 if the budget was used up.
+ */
+static int receive_pending(struct userdata *userdata, lua_State *L)
+{
+	unsigned int portid = mnl_socket_get_portid(userdata->nl);
+
+	for (; userdata->next < userdata->received;
+	     userdata->next++, userdata->offset = 0)
+	{
+		int i = userdata->next;
+		const struct mmsghdr *msg = &userdata->msgs[i];
+		const char *buf = userdata->iov[i].iov_base;
+		const struct nlmsghdr *nlh;
+		int len;
+
+		/* Only accept messages from the kernel */
+		if (userdata->addr[i].nl_pid != 0)
+			continue;
+		/* Skipped, so the next call continues after it */
+		if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+			userdata->next++;
+			userdata->offset = 0;
+			luaL_error(L, "Netlink message truncated, "
+				"bufsize %d too small", (int)userdata->bufsize);
+		}
+
+		userdata->nsid = userdata->nsids[i];
+		nlh = (const struct nlmsghdr *)(buf + userdata->offset);
+		len = msg->msg_len - userdata->offset;
+		while (mnl_nlmsg_ok(nlh, len)) {
+			const struct nlmsghdr *cur = nlh;
+
+			nlh = mnl_nlmsg_next(nlh, &len);
+			userdata->offset = (const char *)nlh - buf;
+			if (cur->nlmsg_pid == portid)
+				async_message(userdata, cur);
+			else if (mnl_cb_run(cur, cur->nlmsg_len, 0, 0,
+					event_cb, userdata) == MNL_CB_ERROR)
+				luaL_error(L, "mnl_cb_run(): %s", strerror(errno));
+			if (budget_exhausted(userdata)) {
+				if (!mnl_nlmsg_ok(nlh, len)) {
+					userdata->next++;
+					userdata->offset = 0;
+				}
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Receive the multicast messages in non-blocking mode until "EAGAIN"
+ * or until the budget of the event() call is used up. The rest of the
+ * datagrams read is processed by the next call.
+ * Up to "nbufs" datagrams are read by a single recvmmsg() call or
+ * taken from the ring of the receiver thread.
+ * Dumps run on separate sockets, see dump_parallel().
+ * A socket overflow (ENOBUFS) is accounted and receiving continues
+ * with the messages still queued. Coalesced events are emitted
+ * afterwards and with "resync" enabled, the state is re-dumped
+ * once all datagrams read are processed.
+ * In case of any other I/O error a lua error is thrown.
+ */
+void receive(struct userdata *userdata, lua_State *L)
+{
+	int fd = mnl_socket_get_fd(userdata->nl);
+	int n, i;
+
+	userdata->L = L;
+	userdata->exhausted = 0;
+	while (!(userdata->exhausted = receive_pending(userdata, L))) {
+		for (i = 0; i < (int)userdata->nbufs; i++) {
+			struct msghdr *hdr = &userdata->msgs[i].msg_hdr;
+
+			hdr->msg_namelen = sizeof *userdata->addr;
+			hdr->msg_controllen = NL_CONTROL_SIZE;
+		}
+
+		if (userdata->receiver) {
+			n = receiver_read(userdata);
+		} else {
+			n = recvmmsg(fd, userdata->msgs, userdata->nbufs, 0, NULL);
+			for (i = 0; i < n; i++)
+				userdata->nsids[i] =
+					netns_nsid(&userdata->msgs[i].msg_hdr);
+		}
+		if (n == -1) {
+			if (errno != ENOBUFS)
+				break;
+			userdata->overflows++;
+			userdata->overflow = 1;
+			userdata->resync_pending = userdata->resync;
+			continue;
+		}
+		userdata->received = n;
+		userdata->next = 0;
+		userdata->offset = 0;
+	}
+
+	userdata->nsid = -1;
+	if (userdata->coalesce_window >= 0)
+		coalesce_flush(userdata, L, userdata->coalesce_window == 0);
+	if (userdata->resync_pending && !userdata->resyncing &&
+	    userdata->next >= userdata->received)
+		state_resync(userdata, L);
+}
+
 /* iterates over a lua set of rtmgrp names ("ifaddr", "link", ...)
  * and puts the group bit RTMGRP_IPV4_IFADDR, RTMGRP_LINK, ...
  * into the groups bitfield
  */
-static int groups_from_set(lua_State *L, int idx)
+int groups_from_set(lua_State *L, int idx)
 {
 	int groups = 0;
 	struct rtmgrp *rtmgrp;
@@ -224,13 +557,62 @@ static int groups_from_set(lua_State *L, int idx)
 	return groups;
 }
 
-/* The "netlink table" is expected as first argument (by calling nl:...)
+/* Fills the array "fields" with the fields to decode per group.
+ * A group in the set at "idx" may have a list of field names as value
+ * instead of "true", e.g. { route = { "dst", "gateway" } }.
+ * Returns 1 if any list was given, 0 if all fields are decoded.
  */
-static struct userdata *get_userdata(lua_State *L)
+int fields_from_set(lua_State *L, int idx, uint32_t *fields)
+{
+	struct rtmgrp *rtmgrp;
+	int ret = 0;
+
+	for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp; rtmgrp++) {
+		uint32_t *f = fields + rtmgrp_index(rtmgrp);
+
+		lua_pushstring(L, rtmgrp->name);
+		lua_gettable(L, idx);
+		if (lua_istable(L, -1)) {
+			*f = fields_from_list(L, lua_gettop(L));
+			ret = 1;
+		} else {
+			*f = NLF_ALL;
+		}
+		lua_pop(L, 1);
+	}
+	return ret;
+}
+
+/* The "netlink table" is expected as first argument (by calling nl:...) */
+struct userdata *get_userdata(lua_State *L)
 {
 	return luaL_checkudata(L, 1, "mnl.netlink");
 }
 
+/* Sets the lua state of the call and resets the field projection, filter,
+ * namespace id and query handle left by a previous call. Only the entry
+ * points emitting entries call it, after check_idle(), so a handler does
+ * not reset the running call.
+ */
+void reset_call(struct userdata *userdata, lua_State *L)
+{
+	userdata->L = L;
+	userdata->projection = userdata->projected ? userdata->fields : NULL;
+	userdata->filter = NULL;
+	userdata->nsid = -1;
+	userdata->query = 0;
+}
+
+/* Raises an error if called by an event handler of the socket:
+ * event(), the queries, snapshot(), changes_since() and stats() use
+ * the result array and receive buffers of the running call.
+ */
+void check_idle(struct userdata *userdata, lua_State *L)
+{
+	if (userdata->busy)
+		luaL_error(L, "Not allowed in an event handler of the socket");
+}
+
 /* Returns an array of registered rtmgrp members like
  * "ifaddr", "link", "route", "arp" for this netlink socket.
  */
@@ -253,41 +635,175 @@ static int nlfunc_groups(lua_State *L)
 
 /* Request current values of all or a list of groups
  * This may be called during start to initially retrieve all current values.
+ * An optional filter table limits the dumps, see filter_from_table().
  */
 static int nlfunc_query(lua_State *L)
 {
 	struct userdata *userdata = get_userdata(L);
 	int groups = userdata->groups;
-	struct rtmgrp *rtmgrp;
+	struct dump_filter filter;
+
+	check_idle(userdata, L);
+	reset_call(userdata, L);
+	if (lua_istable(L, 2)) {
+		uint32_t *fields = userdata->fields + RTMGRP_COUNT;
 
-	if (lua_istable(L, 2))
 		groups = groups_from_set(L, 2);
+		if (fields_from_set(L, 2, fields))
+			userdata->projection = fields;
+	}
+	if (filter_from_table(L, 3, &filter))
+		userdata->filter = &filter;
 
-	lua_settop(L, 1);
-	lua_newtable(L);
+	push_result(userdata, L);
+	userdata->resyncing = NULL;
 
-	for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp; rtmgrp++) {
-		if (groups & rtmgrp->group) {
-			int ret = netlink_initial(userdata->nl, L, rtmgrp->get);
-			if (ret != MNL_CB_OK)
-				break;
-		}
+	/* One dump for the ethtool settings of all links */
+	if (groups & RTMGRP_LINK)
+		ethtool_dump(userdata);
+
+	dump_parallel(userdata, L, groups);
+	userdata->filter = NULL;
+	return 1;
+}
+
+/* Like query(), but the dumps run on a pool of worker threads, by default
+ * one per processor. The optional third argument is the number of threads.
+ */
+static int nlfunc_query_parallel(lua_State *L)
+{
+	struct userdata *userdata = get_userdata(L);
+	int groups = userdata->groups;
+	int threads = dump_thread_count(L, 4);
+	struct dump_filter filter;
+	int filtered;
+
+	check_idle(userdata, L);
+	reset_call(userdata, L);
+	if (lua_istable(L, 2)) {
+		uint32_t *fields = userdata->fields + RTMGRP_COUNT;
+
+		groups = groups_from_set(L, 2);
+		if (fields_from_set(L, 2, fields))
+			userdata->projection = fields;
 	}
+	filtered = filter_from_table(L, 3, &filter);
+
+	push_result(userdata, L);
+	dump_threads(L, userdata->result, &userdata, 1, groups,
+			filtered ? &filter : NULL, threads);
 	return 1;
 }
 
-/* Retrieves events about changed values and triggers the callbacks */
+/* Returns 1 if messages are left after the budget was used up */
+static int event_more(struct userdata *userdata)
+{
+	struct pollfd pfd = {
+		.fd = mnl_socket_get_fd(userdata->nl),
+		.events = POLLIN,
+	};
+
+	if (!userdata->exhausted)
+		return 0;
+	if (userdata->next < userdata->received)
+		return 1;
+	if (userdata->receiver)
+		return receiver_pending(userdata);
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/* Retrieves events about changed values and triggers the callbacks.
+ * An optional table limits the number of messages ("max") and the
+ * time in microseconds ("time") of the call.
+ * The second return value is true, if the socket buffer overflowed
+ * and events were lost since the last call, the third is the number
+ * of coalesced events and the fourth is true if the budget was used up
+ * and more messages are pending.
+ */
 static int nlfunc_event(lua_State *L)
 {
 	struct userdata *userdata = get_userdata(L);
+	lua_Integer max = opt_integer(L, 2, "max", 0);
+	lua_Integer usec = opt_integer(L, 2, "time", 0);
 
-	lua_settop(L, 1);
-	lua_newtable(L);
+	check_idle(userdata, L);
+	reset_call(userdata, L);
+	if (max < 0 || usec < 0)
+		return luaL_error(L, "Invalid event budget");
+	userdata->budget = max;
+	userdata->processed = 0;
+	userdata->deadline = usec ? timestamp_us() + usec : 0;
+
+	push_result(userdata, L);
+	userdata->resyncing = NULL;
+	userdata->coalesced = 0;
+
+	receive(userdata, L);
+	ethtool_monitor(userdata);
+	lua_pushboolean(L, userdata->overflow);
+	userdata->overflow = 0;
+	lua_pushinteger(L, userdata->coalesced);
+	lua_pushboolean(L, event_more(userdata));
+	return 4;
+}
 
-	receive(userdata->nl, L);
+/* Registers a handler function for an event like "newlink" or "delroute".
+ * event() and query() call the handler with each entry of this event
+ * instead of returning it in the array. A nil function removes it.
+ */
+static int nlfunc_on(lua_State *L)
+{
+	struct userdata *userdata = get_userdata(L);
+
+	luaL_checkstring(L, 2);
+	if (!lua_isnoneornil(L, 3))
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+	lua_settop(L, 3);
+
+	if (userdata->handlers == LUA_NOREF) {
+		lua_newtable(L);
+		userdata->handlers = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, userdata->handlers);
+	lua_insert(L, 2);
+	lua_rawset(L, 2);
+	return 0;
+}
+
+/* Returns the number of socket buffer overflows (ENOBUFS) */
+static int nlfunc_overflows(lua_State *L)
+{
+	struct userdata *userdata = get_userdata(L);
+	lua_pushinteger(L, userdata->overflows);
 	return 1;
 }
 
+/* Sets the socket receive buffer size. SO_RCVBUFFORCE
+ * may exceed "rmem_max" but requires CAP_NET_ADMIN.
+ * Fall back to SO_RCVBUF if not permitted.
+ */
+static int set_rcvbuf(struct mnl_socket *nl, int size)
+{
+	int fd = mnl_socket_get_fd(nl);
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof size) == 0)
+		return 0;
+	return setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+}
+
+/* Returns the file descriptor to wait for events, an epoll descriptor
+ * if ethtool notifications are received on a second socket and the
+ * eventfd of the receiver thread, if any
+ */
+int event_fd(const struct userdata *userdata)
+{
+	int fd = ethnl_fd(userdata);
+
+	if (fd < 0)
+		fd = receiver_fd(userdata);
+	return fd < 0 ? mnl_socket_get_fd(userdata->nl) : fd;
+}
+
 /* Returns the netlink filedescriptor to be used in poll or select
  * e.g luaposix poll().
  * Don't close it manually
@@ -295,7 +811,7 @@ static int nlfunc_event(lua_State *L)
 static int nlfunc_fd(lua_State *L)
 {
 	struct userdata *userdata = get_userdata(L);
-	lua_pushinteger(L, mnl_socket_get_fd(userdata->nl));
+	lua_pushinteger(L, event_fd(userdata));
 	return 1;
 }
 
@@ -303,30 +819,67 @@ static int nlfunc_fd(lua_State *L)
 static int nlfunc_poll(lua_State *L)
 {
 	struct userdata *userdata = get_userdata(L);
-	int tout = -1, ret;
+	int tout = -1, pending, ret;
 	struct pollfd pfd = {
-		.fd = mnl_socket_get_fd(userdata->nl),
+		.fd = event_fd(userdata),
 		.events = POLLIN | POLLPRI,
 	};
 
 	if (lua_isinteger(L, 2))
 		tout = lua_tointeger(L, 2);
 
+	/* Messages left by the budget of event() */
+	if (userdata->next < userdata->received) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	/* Wake up when coalesced events are due */
+	pending = coalesce_timeout(userdata);
+	if (pending >= 0 && (tout < 0 || pending < tout))
+		tout = pending;
+	else
+		pending = -1;
+
 	ret = poll(&pfd, 1, tout);
 	if (ret == -1)
 		return luaL_error(L, "poll(): %s\n", strerror(errno));
-	lua_pushboolean(L, ret);
+	lua_pushboolean(L, ret || pending >= 0);
 	return 1;
 }
 
 /* Create a new "netlink socket" userdata with the "mnl_socket_functions[]"
- * as methods via metatable
+ * as methods via metatable.
+ * The optional second argument is a table of socket options:
+ *  buffers: Number of datagrams received by one recvmmsg() call
+ *  bufsize: Size of each receive buffer
+ *  rcvbuf: Kernel socket receive buffer size (SO_RCVBUF)
+ *  no_enobufs: Don't report socket overflows (NETLINK_NO_ENOBUFS)
+ *  state: Keep a copy of the state for snapshot(), get() and changes_since()
+ *  tombstones: Number of deleted objects kept for changes_since()
+ *  resync: Like "state" and re-dump the state after an overflow
+ *  lpm: Keep a route index for lookup() and lookup_many()
+ *  handlers: Table of event handler functions like in on()
+ *  netns: Path or file descriptor of the network namespace to monitor
+ *  all_nsid: Receive the events of all namespaces with an id assigned
+ *   in the own one (NETLINK_LISTEN_ALL_NSID)
  */
 static int netlink_socket(lua_State *L)
 {
-	struct mnl_socket *nl;
+	struct mnl_socket *nl = NULL;
 	struct userdata *userdata;
-	int groups = 0;
+	int groups = 0, netns, prev, all_nsid;
+	lua_Integer nbufs, bufsize, rcvbuf, timeout, ring, tombstones;
+
+	nbufs = opt_integer(L, 2, "buffers", NL_RECV_BUFFERS);
+	bufsize = opt_integer(L, 2, "bufsize", NL_RECV_BUFSIZE);
+	if (nbufs < 1 || nbufs > 1024)
+		return luaL_error(L, "Invalid number of buffers: %d", (int)nbufs);
+	if (bufsize < MNL_SOCKET_BUFFER_SIZE || bufsize > 1024 * 1024)
+		return luaL_error(L, "Invalid buffer size: %d", (int)bufsize);
+	rcvbuf = opt_integer(L, 2, "rcvbuf", 0);
+	if (rcvbuf < 0 || rcvbuf > INT32_MAX / 2)
+		return luaL_error(L, "Invalid receive buffer size: %d", (int)rcvbuf);
 
 	if (lua_istable(L, 1)) {
 		groups = groups_from_set(L, 1);
@@ -340,23 +893,164 @@ static int netlink_socket(lua_State *L)
 	if (!groups)
 		return luaL_error(L, "No netlink groups");
 
-	nl = mnl_socket_open2(NETLINK_ROUTE, SOCK_NONBLOCK | SOCK_CLOEXEC);
-	if (nl == NULL)
-		return luaL_error(L, "mnl_socket_open(): %s", strerror(errno));
+	/* The state of several namespaces can not be told apart */
+	all_nsid = opt_bool(L, 2, "all_nsid");
+	if (all_nsid && (opt_bool(L, 2, "state") || opt_bool(L, 2, "resync") ||
+			opt_bool(L, 2, "lpm") || opt_bool(L, 2, "coalesce")))
+		return luaL_error(L, "all_nsid excludes state, resync, lpm "
+					"and coalesce");
+
+	netns = -1;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "netns");
+		netns = netns_open(L, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+	if (netns_enter(netns, &prev) == 0) {
+		nl = mnl_socket_open2(NETLINK_ROUTE,
+					SOCK_NONBLOCK | SOCK_CLOEXEC);
+		netns_leave(prev);
+	}
+	if (nl == NULL) {
+		int errn = errno;
+		if (netns >= 0)
+			close(netns);
+		return luaL_error(L, "mnl_socket_open(): %s", strerror(errn));
+	}
 
 	if (mnl_socket_bind(nl, groups, MNL_SOCKET_AUTOPID) < 0) {
 		int errn = errno;
 		mnl_socket_close(nl);
+		if (netns >= 0)
+			close(netns);
 		return luaL_error(L, "mnl_socket_bind(%d): %s",
 					groups,strerror(errn));
 	}
+	if (rcvbuf && set_rcvbuf(nl, rcvbuf) < 0) {
+		int errn = errno;
+		mnl_socket_close(nl);
+		if (netns >= 0)
+			close(netns);
+		return luaL_error(L, "setsockopt(SO_RCVBUF, %d): %s",
+					(int)rcvbuf, strerror(errn));
+	}
+	if (opt_bool(L, 2, "no_enobufs")) {
+		int on = 1;
+		if (mnl_socket_setsockopt(nl, NETLINK_NO_ENOBUFS,
+						&on, sizeof on) < 0) {
+			int errn = errno;
+			mnl_socket_close(nl);
+			if (netns >= 0)
+				close(netns);
+			return luaL_error(L, "setsockopt(NETLINK_NO_ENOBUFS): %s",
+						strerror(errn));
+		}
+	}
+	if (all_nsid) {
+		int on = 1;
+		if (mnl_socket_setsockopt(nl, NETLINK_LISTEN_ALL_NSID,
+						&on, sizeof on) < 0) {
+			int errn = errno;
+			mnl_socket_close(nl);
+			if (netns >= 0)
+				close(netns);
+			return luaL_error(L,
+					"setsockopt(NETLINK_LISTEN_ALL_NSID): %s",
+					strerror(errn));
+		}
+	}
 
 	userdata = lua_newuserdata(L, sizeof *userdata);
+	memset(userdata, 0, sizeof *userdata);
 	userdata->nl = nl;
 	userdata->groups = groups;
+	userdata->handlers = LUA_NOREF;
+	userdata->ethtool_fd = -1;
+	userdata->dump_timeout = NL_DUMP_TIMEOUT;
+	userdata->coalesce_window = -1;
+	userdata->netns = netns;
+	userdata->netns_tag = LUA_NOREF;
+	userdata->nsid = -1;
 	/* The garbage collector closes the mnl file descriptor */
 	luaL_setmetatable(L, "mnl.netlink");
 
+	if (alloc_buffers(userdata, nbufs, bufsize) < 0)
+		return luaL_error(L, "malloc(): %s", strerror(errno));
+
+	/* The socket's field set followed by the one of query() */
+	userdata->fields = malloc(2 * RTMGRP_COUNT * sizeof *userdata->fields);
+	if (!userdata->fields)
+		return luaL_error(L, "malloc(): %s", strerror(errno));
+	if (lua_istable(L, 1))
+		userdata->projected = fields_from_set(L, 1, userdata->fields);
+
+	userdata->lazy = opt_bool(L, 2, "lazy");
+	timeout = opt_integer(L, 2, "dump_timeout", NL_DUMP_TIMEOUT);
+	if (timeout < 1 || timeout > INT32_MAX)
+		return luaL_error(L, "Invalid dump timeout: %d", (int)timeout);
+	userdata->dump_timeout = timeout;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "coalesce");
+		if (lua_isinteger(L, -1)) {
+			userdata->coalesce_window = lua_tointeger(L, -1);
+			if (userdata->coalesce_window < 0)
+				return luaL_error(L, "Invalid coalescing window");
+		} else if (lua_toboolean(L, -1)) {
+			userdata->coalesce_window = 0;
+		}
+		lua_pop(L, 1);
+	}
+	ring = opt_integer(L, 2, "ring", NL_RING_SIZE);
+	if (ring < 1 || ring > INT32_MAX)
+		return luaL_error(L, "Invalid ring size: %d", (int)ring);
+	if (opt_bool(L, 2, "thread") && receiver_start(userdata, ring) < 0)
+		return luaL_error(L, "Receiver thread: %s", strerror(errno));
+	/* After the receiver thread, to wait for its signal */
+	if (opt_bool(L, 2, "ethtool"))
+		ethnl_open(userdata);
+	userdata->resync = opt_bool(L, 2, "resync");
+	userdata->keep_deleted = opt_bool(L, 2, "state");
+	tombstones = opt_integer(L, 2, "tombstones", NL_TOMBSTONES);
+	if (tombstones < 0 || tombstones > INT32_MAX)
+		return luaL_error(L, "Invalid number of tombstones: %d",
+					(int)tombstones);
+	userdata->max_deleted = tombstones;
+	if (userdata->resync || userdata->keep_deleted) {
+		userdata->state = calloc(1, sizeof *userdata->state);
+		if (!userdata->state)
+			return luaL_error(L, "calloc(): %s", strerror(errno));
+	}
+	if (opt_bool(L, 2, "lpm")) {
+		userdata->lpm = lpm_new();
+		if (!userdata->lpm)
+			return luaL_error(L, "calloc(): %s", strerror(errno));
+	}
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "netns");
+		if (netns >= 0)
+			userdata->netns_tag = luaL_ref(L, LUA_REGISTRYINDEX);
+		else
+			lua_pop(L, 1);
+
+		lua_getfield(L, 2, "filter");
+		if (lua_istable(L, -1))
+			bpf_attach(L, lua_gettop(L), userdata);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "handlers");
+		if (lua_istable(L, -1)) {
+			lua_newtable(L);
+			lua_pushnil(L);
+			while (lua_next(L, -3)) {
+				lua_pushvalue(L, -2);
+				lua_insert(L, -2);
+				lua_rawset(L, -4);
+			}
+			userdata->handlers = luaL_ref(L, LUA_REGISTRYINDEX);
+		}
+		lua_pop(L, 1);
+	}
+
 	return 1;
 }
 
@@ -381,7 +1075,27 @@ static int netlink_groups(lua_State *L)
 static int userdata_gc(lua_State *L)
 {
 	struct userdata *userdata = lua_touserdata(L, 1);
+	receiver_stop(userdata);
 	mnl_socket_close(userdata->nl);
+	free(userdata->msgs);
+	if (userdata->state) {
+		cache_free(userdata->state);
+		free(userdata->state);
+	}
+	lpm_free(userdata->lpm);
+	free(userdata->fields);
+	dump_free(userdata);
+	ethtool_free(userdata);
+	if (userdata->stats_nl)
+		mnl_socket_close(userdata->stats_nl);
+	if (userdata->write_nl)
+		mnl_socket_close(userdata->write_nl);
+	cache_free(&userdata->stats);
+	cache_free(&userdata->coalesce);
+	if (userdata->netns >= 0)
+		close(userdata->netns);
+	luaL_unref(L, LUA_REGISTRYINDEX, userdata->handlers);
+	luaL_unref(L, LUA_REGISTRYINDEX, userdata->netns_tag);
 	return 0;
 }
 
@@ -389,6 +1103,7 @@ static const struct luaL_Reg netlink_functions[] = {
 	{ "socket", netlink_socket },
 	{ "ethtool", netlink_ethtool },
 	{ "groups", netlink_groups },
+	{ "mux", netlink_mux },
 	{ NULL, NULL }
 };
 
@@ -396,8 +1111,21 @@ static const struct luaL_Reg mnl_socket_functions[] = {
 	{ "fd", nlfunc_fd },
 	{ "event", nlfunc_event },
 	{ "query", nlfunc_query },
+	{ "query_parallel", nlfunc_query_parallel },
+	{ "query_start", nlfunc_query_start },
 	{ "groups", nlfunc_groups },
 	{ "poll", nlfunc_poll },
+	{ "overflows", nlfunc_overflows },
+	{ "snapshot", nlfunc_snapshot },
+	{ "get", nlfunc_get },
+	{ "changes_since", nlfunc_changes_since },
+	{ "version", nlfunc_version },
+	{ "lookup", nlfunc_lookup },
+	{ "lookup_many", nlfunc_lookup_many },
+	{ "query_iter", nlfunc_query_iter },
+	{ "on", nlfunc_on },
+	{ "stats", nlfunc_stats },
+	{ "write", nlfunc_write },
 	{ NULL, NULL }
 };
 
@@ -416,6 +1144,12 @@ int luaopen_netlink(lua_State *L)
 
 		lua_rawset(L, -3);
 	}
+	rtmgrp_init(L);
+	dump_init(L);
+	fields_init(L);
+	message_init(L);
+	mux_init(L);
+	write_init(L);
 	luaL_newlib(L, netlink_functions);
 	return 1;
 }
@@ -6,6 +6,7 @@
 #ifndef NETLINK_LUA_H_
 #define NETLINK_LUA_H_
 
+#include <stdint.h>
 #include <lua.h>
 
 #define TRACE printf("STACK[%d]: %d, top: %s\n", __LINE__,\
@@ -20,9 +21,193 @@ struct ndmsg;
 struct nlattr;
 struct nlmsghdr;
 struct mnl_socket;
+struct mmsghdr;
+struct iovec;
+struct msghdr;
+struct sockaddr_nl;
+struct lpm;
+struct ethnl;
+struct dump_slot;
+struct nlbpf;
+struct receiver;
+struct async_query;
+
+/* Simple hash table with binary keys and values, see cache.c */
+struct cache_entry {
+	struct cache_entry *next;
+	uint64_t version;
+	uint32_t mark;
+	uint32_t flags;
+	uint32_t hash;
+	uint32_t keylen;
+	uint32_t len;
+	unsigned char data[];   /* key, aligned value */
+};
+
+struct cache {
+	struct cache_entry **buckets;
+	size_t size;
+	size_t count;
+};
+
+#define CACHE_ALIGN(x) (((x) + 7) & ~7)
+
+static inline void *cache_value(const struct cache_entry *e)
+{
+	return (void *)(e->data + CACHE_ALIGN(e->keylen));
+}
+
+/* Default number and size of the receive buffers used by recvmmsg() */
+#define NL_RECV_BUFFERS 8
+#define NL_RECV_BUFSIZE 8192
+
+/* Default size of the ring of the receiver thread */
+#define NL_RING_SIZE (4 * 1024 * 1024)
+
+/* Default timeout in milliseconds for a dump to complete */
+#define NL_DUMP_TIMEOUT 5000
+
+/* Number of retries of a dump interrupted by changes (NLM_F_DUMP_INTR) */
+#define NL_DUMP_RETRIES 3
+
+/* Default number of deleted objects kept for changes_since() */
+#define NL_TOMBSTONES 4096
+
+struct userdata {
+	struct mnl_socket *nl;
+	int groups;
+	/* receive buffer set: "nbufs" datagrams of "bufsize" bytes each */
+	unsigned int nbufs;
+	size_t bufsize;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	struct sockaddr_nl *addr;
+	char *buf;
+	/* Control data and namespace id (NETLINK_LISTEN_ALL_NSID) of each
+	 * datagram, -1 for the own namespace
+	 */
+	char *control;
+	int *nsids;
+	/* ENOBUFS: total count and flag for the current receive() */
+	lua_Integer overflows;
+	int overflow;
+	/* Datagrams of the last recvmmsg() not processed yet: "received"
+	 * count, index of the "next" one and the "offset" of its next message
+	 */
+	int received, next;
+	size_t offset;
+	/* Budget of the current event() call: maximum number of messages
+	 * and CLOCK_MONOTONIC deadline in microseconds, 0 if unlimited
+	 */
+	lua_Integer budget, processed, deadline;
+	int exhausted;
+	/* Receiver thread filling a ring with the datagrams or NULL */
+	struct receiver *receiver;
+	/* lua state of the current receive() */
+	lua_State *L;
+	/* Namespace of the sockets or -1, registry reference of the value
+	 * tagging the events and the id of the current datagram's namespace
+	 */
+	int netns;
+	int netns_tag;
+	int nsid;
+	/* Timeout of dumps in milliseconds */
+	int dump_timeout;
+	/* Copy of the last known state for "state" and "resync" */
+	struct cache *state;
+	uint64_t version;
+	int keep_deleted;
+	/* Number of deleted objects kept, its limit and the newest version
+	 * of a deleted object dropped by the limit
+	 */
+	size_t deleted, max_deleted;
+	uint64_t dropped;
+	int resync, resync_pending;
+	const struct rtmgrp *resyncing;
+	uint32_t mark;
+	/* Longest prefix match route index */
+	struct lpm *lpm;
+	/* Registry reference of the event handler table */
+	int handlers;
+	/* Stack index and number of entries of the result array */
+	int result;
+	lua_Integer nresults;
+	/* An event handler is running, see emit_entry() */
+	int busy;
+	/* Emit "mnl.message" objects instead of tables */
+	int lazy;
+	/* Fields to decode per group (rtmgrp_index()) of the socket,
+	 * if "projected", and of query(). "projection" is the set of the
+	 * running call or NULL for all fields.
+	 */
+	uint32_t *fields;
+	int projected;
+	const uint32_t *projection;
+	/* Filter of the running query() or NULL */
+	const struct dump_filter *filter;
+	/* ethtool control socket and settings per interface index */
+	int ethtool_fd;
+	struct cache ethtool;
+	/* ethtool generic netlink backend or NULL for the ioctl */
+	struct ethnl *ethnl;
+	/* Dump socket and previous samples per interface of stats() */
+	struct mnl_socket *stats_nl;
+	unsigned int stats_seq;
+	uint32_t stats_mark;
+	struct cache stats;
+	/* Socket and last sequence number of write() */
+	struct mnl_socket *write_nl;
+	unsigned int write_seq;
+	/* Dump sockets of query(), one per group (rtmgrp_index()) */
+	struct dump_slot *dumps;
+	/* Queries of query_start() dumped on the event socket, the last
+	 * handle and sequence number and the handle of the entry being
+	 * emitted or 0
+	 */
+	struct async_query *async;
+	lua_Integer async_handle, query;
+	unsigned int async_seq;
+	/* Coalescing window in milliseconds, 0 for each event() call and
+	 * -1 if disabled. Held back messages per object and the number
+	 * of merged events of the current event() call.
+	 */
+	lua_Integer coalesce_window;
+	struct cache coalesce;
+	uint64_t coalesce_seq;
+	lua_Integer coalesced;
+};
+
+/* Fields of the decoded messages, names in nlfield_names[] */
+enum nlfield {
+	NLF_INDEX, NLF_FAMILY, NLF_RUNNING, NLF_UP, NLF_MTU, NLF_NAME,
+	NLF_HWADDR, NLF_SPEED, NLF_DUPLEX, NLF_AUTONEG, NLF_PREFIXLEN,
+	NLF_SCOPE, NLF_FLAGS, NLF_IP, NLF_SRC, NLF_DST, NLF_GATEWAY,
+	NLF_PREFSRC, NLF_METRIC, NLF_STATE, NLF_PROBES,
+	NLF_MAX
+};
+
+/* Keys of the entries set for all messages, after the fields */
+#define NLF_EVENT NLF_MAX
+#define NLF_STAMP (NLF_MAX +1)
+#define NLF_NETNS (NLF_MAX +2)
+#define NLF_QUERY (NLF_MAX +3)
+
+#define NLF_BIT(x) (UINT32_C(1) << (x))
+#define NLF_ALL (NLF_BIT(NLF_MAX) - 1)
+#define NLF_ETHTOOL (NLF_BIT(NLF_SPEED) | NLF_BIT(NLF_DUPLEX) | \
+			NLF_BIT(NLF_AUTONEG))
+#define WANTED(cbd, field) ((cbd)->fields & NLF_BIT(field))
+
+extern const char *const nlfield_names[NLF_MAX];
 
 struct callback_data {
 	lua_State *L;
+	/* Bitmask of the NLF_... fields to decode */
+	uint32_t fields;
+	/* Stack index of the key string table, see push_keys() */
+	int keys;
+	/* Socket of the message, NULL for message objects */
+	struct userdata *userdata;
 	union {
 		struct rtmsg *rtm;
 		struct ifinfomsg *ifm;
@@ -32,6 +217,40 @@ struct callback_data {
 	};
 };
 
+/* Filter of query() and query_iter(), see filter_from_table().
+ * Zero members match everything.
+ */
+struct dump_filter {
+	int family;
+	uint32_t index;
+	uint32_t table;
+	int protocol;
+	/* NUD_... bits of the neighbour state */
+	int state;
+};
+
+/* Event filter of the socket option "filter", compiled to a classic
+ * BPF program by bpf_attach(). Empty sets match everything.
+ */
+#define NL_FILTER_MAX 64
+
+struct event_filter {
+	uint32_t index[NL_FILTER_MAX];
+	uint32_t table[NL_FILTER_MAX];
+	uint32_t types[NL_FILTER_MAX];
+	int nindex, ntable, ntypes;
+	/* NUD_... bits of the neighbour state */
+	int state;
+};
+
+/* Message types below are dispatched by table instead of a group scan */
+#define NL_TYPE_MAX 256
+
+/* Maximum size of a state key generated by the rtmgrp "key" function */
+#define NL_KEY_MAX 64
+
+#define NLA_BIT(x) (UINT64_C(1) << (x))
+
 struct rtmgrp {
 	const char *name;
 	int group;
@@ -39,6 +258,38 @@ struct rtmgrp {
 	int new;
 	int del;
 	int get;
+	/* Size of the family specific header (ifinfomsg, rtmsg, ...) */
+	size_t hdrlen;
+	/* Attributes kept in the state copy of a message */
+	uint64_t attrs;
+	/* Writes the identifying key of the object to "key" and returns
+	 * its length or 0 if the object is not tracked.
+	 * Volatile header values may be cleared in the copy "nlh".
+	 */
+	size_t (*key) (struct nlmsghdr *nlh, unsigned char *key);
+	/* Builds the same key from the lua arguments starting at "idx" */
+	size_t (*lua_key) (lua_State *L, int idx, unsigned char *key);
+	/* Expected number of fields, to create presized tables */
+	int nfields;
+	/* Puts the filter into the zeroed family header of a dump request
+	 * and appends attributes, as accepted by the strict checking of
+	 * the kernel (NETLINK_GET_STRICT_CHK).
+	 */
+	void (*request) (struct nlmsghdr *nlh, const struct dump_filter *filter);
+	/* Returns 0 if the message does not match the filter. Checks the
+	 * parts the kernel can not filter or ignores without strict checking.
+	 */
+	int (*match) (const struct nlmsghdr *nlh,
+			const struct dump_filter *filter);
+	/* Emits the BPF checks of the event filter for the messages of the
+	 * group, see bpf.c. Nothing is emitted if no part of it applies.
+	 */
+	void (*bpf) (struct nlbpf *prog, const struct event_filter *filter);
+	/* Puts the object of the lua table at "idx" into the zeroed family
+	 * header of a "new" or "del" request and appends its attributes.
+	 * Returns NULL or the message of an invalid value, see write.c.
+	 */
+	const char *(*build) (struct nlmsghdr *nlh, lua_State *L, int idx);
 };
 
 #define LUA_RTMGRP(x) \
@@ -47,23 +298,152 @@ struct rtmgrp {
 extern struct rtmgrp __start_rtmgrp;
 extern struct rtmgrp __stop_rtmgrp;
 
+#define RTMGRP_COUNT ((size_t)(&__stop_rtmgrp - &__start_rtmgrp))
+#define rtmgrp_index(x) ((size_t)((x) - &__start_rtmgrp))
+
 int luaopen_netlink(lua_State *L);
 int netlink_ethtool(lua_State *L);
+int ethtool_get(struct callback_data *cbd, const char *ifname);
+void ethtool_link(struct callback_data *cbd, uint32_t index,
+		const char *ifname, uint32_t link);
+void ethtool_forget(struct userdata *userdata, uint32_t index);
+void ethtool_free(struct userdata *userdata);
+void ethnl_open(struct userdata *userdata);
+int ethnl_fd(const struct userdata *userdata);
+void ethtool_dump(struct userdata *userdata);
+void ethtool_monitor(struct userdata *userdata);
 
 const char *af_to_str(int af);
 
-void push_string(lua_State *L, const char *which, const char *value);
-void push_integer(lua_State *L, const char *which, lua_Integer value);
-void push_bool(lua_State *L, const char *which, int value);
-void push_u32_attr(lua_State *L, const char *which, const struct nlattr *attr);
-void push_ip(lua_State *L, const char *which, int family,
+lua_Integer timestamp(void);
+lua_Integer timestamp_us(void);
+void set_string(lua_State *L, const char *which, const char *value);
+void set_integer(lua_State *L, const char *which, lua_Integer value);
+void fields_init(lua_State *L);
+int push_keys(lua_State *L);
+
+void push_string(struct callback_data *cbd, enum nlfield field,
+		const char *value);
+void push_integer(struct callback_data *cbd, enum nlfield field,
+		lua_Integer value);
+void push_bool(struct callback_data *cbd, enum nlfield field, int value);
+void push_u32_attr(struct callback_data *cbd, enum nlfield field,
+		const struct nlattr *attr);
+void push_ip(struct callback_data *cbd, enum nlfield field, int family,
 		const struct nlattr *attr);
-void push_cidr(lua_State *L, const char *which, int family,
+void push_cidr(struct callback_data *cbd, enum nlfield field, int family,
 		const struct nlattr *attr, int cidr);
-void push_hwaddr(lua_State *L, const char *which,
+void push_hwaddr(struct callback_data *cbd, enum nlfield field,
 		const struct nlattr *attr);
 
-int netlink_initial(struct mnl_socket *nl, lua_State *L, int type);
-int receive(struct mnl_socket *nl, lua_State *L);
+int parse_addr(const char *str, int *family, void *addr, int *prefixlen);
+
+lua_Integer opt_integer(lua_State *L, int idx, const char *which,
+		lua_Integer def);
+int opt_bool(lua_State *L, int idx, const char *which);
+
+int netlink_request(struct mnl_socket *nl, const struct rtmgrp *rtmgrp,
+		unsigned int seq, const struct dump_filter *filter);
+void receive(struct userdata *userdata, lua_State *L);
+int data_cb(const struct nlmsghdr *nlh, void *data);
+const struct rtmgrp *rtmgrp_by_type(int type);
+void push_event(lua_State *L, int type);
+const struct rtmgrp *rtmgrp_by_name(lua_State *L, int idx);
+struct userdata *get_userdata(lua_State *L);
+void check_idle(struct userdata *userdata, lua_State *L);
+void reset_call(struct userdata *userdata, lua_State *L);
+int event_fd(const struct userdata *userdata);
+int push_message(struct userdata *userdata, const struct rtmgrp *rtmgrp,
+		const struct nlmsghdr *nlh);
+int push_netns(struct userdata *userdata, lua_State *L);
+void push_result(struct userdata *userdata, lua_State *L);
+void emit_message(struct userdata *userdata, const struct rtmgrp *rtmgrp,
+		const struct nlmsghdr *nlh);
+void emit_entry(struct userdata *userdata);
+void index_update(struct userdata *userdata, const struct nlmsghdr *nlh);
+const struct rtmgrp *update_message(struct userdata *userdata,
+		const struct nlmsghdr *nlh);
+int groups_from_set(lua_State *L, int idx);
+int fields_from_set(lua_State *L, int idx, uint32_t *fields);
+
+struct cache_entry *cache_get(const struct cache *c,
+		const void *key, size_t keylen);
+struct cache_entry *cache_put(struct cache *c, const void *key, size_t keylen,
+		const void *value, size_t len);
+void cache_del(struct cache *c, struct cache_entry *entry);
+struct cache_entry *cache_next(const struct cache *c,
+		const struct cache_entry *entry);
+void cache_free(struct cache *c);
+
+int state_update(struct userdata *userdata, const struct rtmgrp *rtmgrp,
+		const struct nlmsghdr *nlh);
+int state_has(struct userdata *userdata, const struct rtmgrp *rtmgrp,
+		const struct nlmsghdr *nlh);
+void state_resync(struct userdata *userdata, lua_State *L);
+int nlfunc_snapshot(lua_State *L);
+int nlfunc_get(lua_State *L);
+int nlfunc_changes_since(lua_State *L);
+int nlfunc_version(lua_State *L);
+
+struct lpm *lpm_new(void);
+void lpm_free(struct lpm *lpm);
+int lpm_update(struct lpm *lpm, const struct nlmsghdr *nlh);
+int nlfunc_lookup(lua_State *L);
+int nlfunc_lookup_many(lua_State *L);
+
+int nlfunc_stats(lua_State *L);
+
+int neigh_state_bits(lua_State *L, int idx);
+
+void bpf_emit(struct nlbpf *p, uint16_t code, uint8_t jt, uint8_t jf,
+		uint32_t k);
+void bpf_load(struct nlbpf *p, int size, uint32_t offset);
+void bpf_load_attr(struct nlbpf *p, size_t hdrlen, int type);
+void bpf_in_set(struct nlbpf *p, int size, const uint32_t *set, int n);
+void bpf_any_bit(struct nlbpf *p, uint16_t bits);
+void bpf_attach(lua_State *L, int idx, struct userdata *userdata);
+
+int coalesce_add(struct userdata *userdata, struct nlmsghdr *nlh);
+void coalesce_flush(struct userdata *userdata, lua_State *L, int all);
+int coalesce_timeout(const struct userdata *userdata);
+
+int netns_open(lua_State *L, int idx);
+int netns_enter(int netns, int *prev);
+void netns_leave(int prev);
+int netns_nsid(struct msghdr *msg);
+
+int receiver_start(struct userdata *userdata, size_t size);
+void receiver_stop(struct userdata *userdata);
+int receiver_fd(const struct userdata *userdata);
+int receiver_pending(const struct userdata *userdata);
+int receiver_read(struct userdata *userdata);
+
+int write_addr(struct nlmsghdr *nlh, lua_State *L, int idx,
+		const char *which, int type, int *family, int *prefixlen);
+int write_integer(lua_State *L, int idx, const char *which,
+		lua_Integer *value);
+int nlfunc_write(lua_State *L);
+void write_init(lua_State *L);
+
+void dump_init(lua_State *L);
+struct mnl_socket *dump_socket(struct userdata *userdata, lua_State *L);
+int filter_from_table(lua_State *L, int idx, struct dump_filter *filter);
+int nlfunc_query_iter(lua_State *L);
+void dump_parallel(struct userdata *userdata, lua_State *L, int groups);
+void dump_threads(lua_State *L, int result, struct userdata **users, size_t n,
+		int groups, const struct dump_filter *filter, int threads);
+int dump_thread_count(lua_State *L, int idx);
+void dump_free(struct userdata *userdata);
+void async_message(struct userdata *userdata, const struct nlmsghdr *nlh);
+int nlfunc_query_start(lua_State *L);
+
+void message_init(lua_State *L);
+uint32_t fields_from_list(lua_State *L, int idx);
+int message_new(struct userdata *userdata, const struct rtmgrp *rtmgrp,
+		const struct nlmsghdr *nlh);
+void message_set(lua_State *L, const char *which);
+
+void mux_init(lua_State *L);
+int netlink_mux(lua_State *L);
 
 #endif
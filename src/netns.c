@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2021 Christian Hohnstaedt
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE /* setns() */
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "netlink.h"
+
+/* Added in Linux 4.2 */
+#ifndef NETLINK_LISTEN_ALL_NSID
+#define NETLINK_LISTEN_ALL_NSID 8
+#endif
+
+/* Network namespaces of the socket option "netns". A netlink socket
+ * stays in the namespace it was created in, so the calling thread
+ * switches into the namespace only to create the sockets.
+ */
+
+/* Returns a file descriptor of the namespace path or descriptor at
+ * "idx" or -1 if it is nil
+ */
+int netns_open(lua_State *L, int idx)
+{
+	int fd;
+
+	if (lua_isnil(L, idx))
+		return -1;
+	if (lua_isinteger(L, idx))
+		fd = fcntl(lua_tointeger(L, idx), F_DUPFD_CLOEXEC, 0);
+	else
+		fd = open(luaL_checkstring(L, idx), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		luaL_error(L, "Network namespace '%s': %s",
+				luaL_tolstring(L, idx, NULL), strerror(errno));
+	return fd;
+}
+
+/* Switches the calling thread into the namespace "netns", if >= 0.
+ * The previous namespace is returned in "prev" for netns_leave().
+ * Returns -1 with errno set on error.
+ */
+int netns_enter(int netns, int *prev)
+{
+	int err;
+
+	*prev = -1;
+	if (netns < 0)
+		return 0;
+	*prev = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+	if (*prev < 0)
+		*prev = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+	if (*prev < 0)
+		return -1;
+	if (setns(netns, CLONE_NEWNET) == 0)
+		return 0;
+	err = errno;
+	close(*prev);
+	*prev = -1;
+	errno = err;
+	return -1;
+}
+
+/* Returns into the namespace saved by netns_enter() */
+void netns_leave(int prev)
+{
+	int err = errno;
+
+	if (prev < 0)
+		return;
+	setns(prev, CLONE_NEWNET);
+	close(prev);
+	errno = err;
+}
+
+/* Returns the id of the namespace a datagram of a NETLINK_LISTEN_ALL_NSID
+ * socket was sent in or -1 for the own namespace
+ */
+int netns_nsid(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	int nsid;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_NETLINK &&
+		    cmsg->cmsg_type == NETLINK_LISTEN_ALL_NSID &&
+		    cmsg->cmsg_len >= CMSG_LEN(sizeof nsid)) {
+			memcpy(&nsid, CMSG_DATA(cmsg), sizeof nsid);
+			return nsid;
+		}
+	}
+	return -1;
+}
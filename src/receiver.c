@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2021 Christian Hohnstaedt
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE /* struct mmsghdr */
+
+#include <lua.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <libmnl/libmnl.h>
+#include <linux/netlink.h>
+
+#include "netlink.h"
+
+/* Receiver thread of the socket option "thread": It drains the netlink
+ * socket continuously and copies the datagrams of the kernel into a
+ * single producer, single consumer ring. receive() takes them from the
+ * ring instead of the socket, so the kernel socket buffer does not
+ * overflow while lua is busy. The thread never touches the lua state.
+ *
+ * "efd" signals lua that datagrams are in the ring. It is cleared by
+ * the consumer only when the ring is empty. "wake" wakes the thread
+ * to stop or when space became free in a full ring.
+ */
+
+/* Ring record: "len" bytes of the datagram follow, MSG_TRUNC in "flags"
+ * and the namespace id in "nsid". A record with RING_PAD fills the rest
+ * of the ring before wrapping.
+ */
+struct ring_rec {
+	uint32_t len;
+	uint32_t flags;
+	int32_t nsid;
+	uint32_t reserved;
+};
+
+#define RING_PAD UINT32_MAX
+#define RING_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+struct receiver {
+	pthread_t thread;
+	int nlfd, efd, wake;
+	atomic_int stop;
+	int started;
+	/* The producer waits for free space */
+	atomic_int waiting;
+	/* ENOBUFS of the socket not reported to lua yet */
+	atomic_uint overflows;
+	/* Positions in bytes, only growing */
+	atomic_size_t head, tail;
+	size_t size;
+	unsigned char *ring;
+	/* Datagram of the thread, "pending" if it did not fit into the ring */
+	size_t bufsize, pending;
+	uint32_t flags;
+	int32_t nsid;
+	unsigned char buf[];
+};
+
+/* Copies the datagram into the ring. Returns 0 if the ring is full */
+static int ring_put(struct receiver *r, const void *data, size_t len,
+			uint32_t flags, int32_t nsid)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	size_t need = RING_ALIGN(sizeof(struct ring_rec) + len);
+	size_t off = head & (r->size - 1), pad = 0;
+	struct ring_rec *rec;
+
+	if (r->size - off < need)
+		pad = r->size - off;
+	if (r->size - (head - tail) < pad + need)
+		return 0;
+
+	if (pad) {
+		rec = (struct ring_rec *)(r->ring + off);
+		rec->len = RING_PAD;
+		head += pad;
+		off = 0;
+	}
+	rec = (struct ring_rec *)(r->ring + off);
+	rec->len = len;
+	rec->flags = flags;
+	rec->nsid = nsid;
+	memcpy(rec + 1, data, len);
+	atomic_store_explicit(&r->head, head + need, memory_order_release);
+	return 1;
+}
+
+/* Stores the datagram of the thread buffer or waits for free space */
+static int receiver_put(struct receiver *r)
+{
+	if (!ring_put(r, r->buf, r->pending, r->flags, r->nsid)) {
+		atomic_store(&r->waiting, 1);
+		/* The consumer may have freed space before seeing "waiting".
+		 * The fence orders the store before the load of "tail",
+		 * paired with the one in receiver_read().
+		 */
+		atomic_thread_fence(memory_order_seq_cst);
+		if (!ring_put(r, r->buf, r->pending, r->flags, r->nsid))
+			return 0;
+	}
+	if (atomic_load_explicit(&r->waiting, memory_order_relaxed))
+		atomic_store(&r->waiting, 0);
+	r->pending = 0;
+	return 1;
+}
+
+/* Reads the socket until EAGAIN or until the ring is full.
+ * lua is signalled early, if the ring was empty, and after the last
+ * stored datagram.
+ */
+static void receiver_drain(struct receiver *r)
+{
+	int stored = 0;
+
+	for (;;) {
+		struct sockaddr_nl addr;
+		struct iovec iov = { r->buf, r->bufsize };
+		char control[CMSG_SPACE(sizeof(int))];
+		struct msghdr msg = {
+			.msg_name = &addr,
+			.msg_namelen = sizeof addr,
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control,
+			.msg_controllen = sizeof control,
+		};
+		ssize_t len;
+
+		if (r->pending) {
+			int empty = atomic_load(&r->head) ==
+					atomic_load(&r->tail);
+
+			if (!receiver_put(r))
+				break;
+			if (empty)
+				eventfd_write(r->efd, 1);
+			stored = 1;
+		}
+
+		len = recvmsg(r->nlfd, &msg, MSG_DONTWAIT);
+		if (len < 0 && errno == ENOBUFS) {
+			atomic_fetch_add(&r->overflows, 1);
+			continue;
+		}
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			break;
+		/* Only accept messages from the kernel */
+		if (addr.nl_pid != 0)
+			continue;
+		r->pending = len;
+		r->flags = msg.msg_flags & MSG_TRUNC;
+		r->nsid = netns_nsid(&msg);
+	}
+	if (stored)
+		eventfd_write(r->efd, 1);
+}
+
+static void *receiver_main(void *arg)
+{
+	struct receiver *r = arg;
+	struct pollfd pfd[2] = {
+		{ .fd = r->nlfd, .events = POLLIN },
+		{ .fd = r->wake, .events = POLLIN },
+	};
+	eventfd_t value;
+
+	while (!atomic_load(&r->stop)) {
+		/* A full ring is retried when woken up */
+		pfd[0].fd = r->pending ? -1 : r->nlfd;
+		if (poll(pfd, 2, -1) < 0)
+			continue;
+		if (pfd[1].revents & POLLIN)
+			eventfd_read(r->wake, &value);
+		receiver_drain(r);
+	}
+	return NULL;
+}
+
+/* Stops the thread and frees the ring */
+void receiver_stop(struct userdata *userdata)
+{
+	struct receiver *r = userdata->receiver;
+
+	if (!r)
+		return;
+	if (r->started) {
+		atomic_store(&r->stop, 1);
+		eventfd_write(r->wake, 1);
+		pthread_join(r->thread, NULL);
+	}
+	if (r->efd >= 0)
+		close(r->efd);
+	if (r->wake >= 0)
+		close(r->wake);
+	free(r->ring);
+	free(r);
+	userdata->receiver = NULL;
+}
+
+/* Starts the thread with a ring of at least "size" bytes.
+ * Returns -1 with errno set on error.
+ */
+int receiver_start(struct userdata *userdata, size_t size)
+{
+	struct receiver *r;
+	size_t ringsize = 4096;
+	int err;
+
+	/* Two records of the largest size always fit into an empty ring,
+	 * even with the padding before wrapping
+	 */
+	while (ringsize < size + 2 * RING_ALIGN(sizeof(struct ring_rec) +
+				userdata->bufsize))
+		ringsize *= 2;
+	r = calloc(1, sizeof *r + userdata->bufsize);
+	if (!r)
+		return -1;
+	userdata->receiver = r;
+	r->ring = malloc(ringsize);
+	r->size = ringsize;
+	r->bufsize = userdata->bufsize;
+	r->nlfd = mnl_socket_get_fd(userdata->nl);
+	r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	r->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (!r->ring || r->efd < 0 || r->wake < 0)
+		goto error;
+
+	err = pthread_create(&r->thread, NULL, receiver_main, r);
+	if (err) {
+		errno = err;
+		goto error;
+	}
+	r->started = 1;
+	return 0;
+
+error:
+	err = errno;
+	receiver_stop(userdata);
+	errno = err;
+	return -1;
+}
+
+/* Returns the file descriptor signalling datagrams in the ring or -1 */
+int receiver_fd(const struct userdata *userdata)
+{
+	return userdata->receiver ? userdata->receiver->efd : -1;
+}
+
+/* Returns 1 if datagrams are in the ring */
+int receiver_pending(const struct userdata *userdata)
+{
+	struct receiver *r = userdata->receiver;
+
+	return r && atomic_load(&r->head) != atomic_load(&r->tail);
+}
+
+/* Takes up to "nbufs" datagrams from the ring into the receive buffers,
+ * like recvmmsg(). Returns -1 with errno EAGAIN if the ring is empty
+ * or ENOBUFS once after the thread saw socket overflows.
+ */
+int receiver_read(struct userdata *userdata)
+{
+	struct receiver *r = userdata->receiver;
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	unsigned int overflows = atomic_exchange(&r->overflows, 0);
+	unsigned int n = 0;
+	eventfd_t value;
+
+	if (overflows) {
+		userdata->overflows += overflows - 1;
+		errno = ENOBUFS;
+		return -1;
+	}
+	if (tail == head) {
+		/* Clear the signal, the thread sets it after storing again */
+		eventfd_read(r->efd, &value);
+		head = atomic_load_explicit(&r->head, memory_order_acquire);
+	}
+
+	while (n < userdata->nbufs && tail != head) {
+		const struct ring_rec *rec;
+
+		rec = (const struct ring_rec *)(r->ring + (tail & (r->size - 1)));
+		if (rec->len == RING_PAD) {
+			tail += r->size - (tail & (r->size - 1));
+			continue;
+		}
+		memcpy(userdata->iov[n].iov_base, rec + 1, rec->len);
+		userdata->msgs[n].msg_len = rec->len;
+		userdata->msgs[n].msg_hdr.msg_flags = rec->flags;
+		userdata->nsids[n] = rec->nsid;
+		userdata->addr[n].nl_pid = 0;
+		tail += RING_ALIGN(sizeof *rec + rec->len);
+		n++;
+	}
+	atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+	/* Orders the store of "tail" before the load of "waiting",
+	 * otherwise the thread may sleep on a ring it sees full
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (n && atomic_load(&r->waiting))
+		eventfd_write(r->wake, 1);
+	if (!n) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return n;
+}
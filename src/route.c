@@ -5,6 +5,10 @@
 
 #include <lua.h>
 #include <lualib.h>
+#include <lauxlib.h>
+
+#include <stddef.h>
+#include <string.h>
 
 #include <libmnl/libmnl.h>
 #include <linux/rtnetlink.h>
@@ -18,24 +22,24 @@ static int parse_attr(const struct nlattr *attr, void *data)
 
 	switch(type) {
 	case RTA_SRC:
-		push_cidr(cbd->L, "src", cbd->rtm->rtm_family,
+		push_cidr(cbd, NLF_SRC, cbd->rtm->rtm_family,
 				attr, cbd->rtm->rtm_src_len);
 		break;
 	case RTA_DST:
-		push_cidr(cbd->L, "dst", cbd->rtm->rtm_family,
+		push_cidr(cbd, NLF_DST, cbd->rtm->rtm_family,
 				attr, cbd->rtm->rtm_dst_len);
 		break;
 	case RTA_GATEWAY:
-		push_ip(cbd->L, "gateway", cbd->rtm->rtm_family, attr);
+		push_ip(cbd, NLF_GATEWAY, cbd->rtm->rtm_family, attr);
 		break;
 	case RTA_PREFSRC:
-		push_ip(cbd->L, "prefsrc", cbd->rtm->rtm_family, attr);
+		push_ip(cbd, NLF_PREFSRC, cbd->rtm->rtm_family, attr);
 		break;
 	case RTA_OIF:
-		push_u32_attr(cbd->L, "index", attr);
+		push_u32_attr(cbd, NLF_INDEX, attr);
 		break;
 	case RTA_PRIORITY:
-		push_u32_attr(cbd->L, "metric", attr);
+		push_u32_attr(cbd, NLF_METRIC, attr);
 		break;
 	}
 	return MNL_CB_OK;
@@ -46,12 +50,204 @@ static int route_cb(const struct nlmsghdr *nlh, struct callback_data *cbd)
 	if (cbd->rtm->rtm_type != RTN_UNICAST)
 		return MNL_CB_STOP;
 
-	push_integer(cbd->L, "scope", cbd->rtm->rtm_scope);
+	push_integer(cbd, NLF_SCOPE, cbd->rtm->rtm_scope);
 	return mnl_attr_parse(nlh, sizeof(*cbd->rtm), parse_attr, cbd);
 }
 
+/* Routes are identified by table, destination, source,
+ * TOS and priority. Only unicast routes are tracked.
+ */
+struct route_key {
+	uint32_t table, priority;
+	uint8_t family, dst_len, src_len, tos;
+	uint8_t dst[16], src[16];
+};
+
+static size_t route_key(struct nlmsghdr *nlh, unsigned char *key)
+{
+	const struct rtmsg *rtm = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr;
+	struct route_key k;
+
+	if (rtm->rtm_type != RTN_UNICAST)
+		return 0;
+
+	memset(&k, 0, sizeof k);
+	k.table = rtm->rtm_table;
+	k.family = rtm->rtm_family;
+	k.dst_len = rtm->rtm_dst_len;
+	k.src_len = rtm->rtm_src_len;
+	k.tos = rtm->rtm_tos;
+
+	mnl_attr_for_each(attr, nlh, sizeof *rtm) {
+		size_t len = mnl_attr_get_payload_len(attr);
+
+		switch (mnl_attr_get_type(attr)) {
+		case RTA_TABLE:
+			k.table = mnl_attr_get_u32(attr);
+			break;
+		case RTA_PRIORITY:
+			k.priority = mnl_attr_get_u32(attr);
+			break;
+		case RTA_DST:
+			if (len <= sizeof k.dst)
+				memcpy(k.dst, mnl_attr_get_payload(attr), len);
+			break;
+		case RTA_SRC:
+			if (len <= sizeof k.src)
+				memcpy(k.src, mnl_attr_get_payload(attr), len);
+			break;
+		}
+	}
+	memcpy(key, &k, sizeof k);
+	return sizeof k;
+}
+
+/* Arguments: "destination/prefixlen", optional table and metric */
+static size_t route_lua_key(lua_State *L, int idx, unsigned char *key)
+{
+	struct route_key k;
+	int family, prefixlen;
+
+	memset(&k, 0, sizeof k);
+	if (parse_addr(luaL_checkstring(L, idx), &family, k.dst,
+			&prefixlen) < 0)
+		return luaL_argerror(L, idx, "Invalid destination");
+	k.family = family;
+	k.dst_len = prefixlen;
+	k.table = luaL_optinteger(L, idx +1, RT_TABLE_MAIN);
+	k.priority = luaL_optinteger(L, idx +2, 0);
+	memcpy(key, &k, sizeof k);
+	return sizeof k;
+}
+
+/* The kernel filters route dumps by the header and RTA_TABLE, RTA_OIF */
+static void route_request(struct nlmsghdr *nlh, const struct dump_filter *f)
+{
+	struct rtmsg *rtm = mnl_nlmsg_get_payload(nlh);
+
+	rtm->rtm_family = f->family;
+	rtm->rtm_type = RTN_UNICAST;
+	rtm->rtm_protocol = f->protocol;
+	if (f->table) {
+		rtm->rtm_table = f->table < 256 ? f->table : RT_TABLE_COMPAT;
+		mnl_attr_put_u32(nlh, RTA_TABLE, f->table);
+	}
+	if (f->index)
+		mnl_attr_put_u32(nlh, RTA_OIF, f->index);
+}
+
+static int route_match(const struct nlmsghdr *nlh, const struct dump_filter *f)
+{
+	const struct rtmsg *rtm = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr;
+	uint32_t table = rtm->rtm_table, oif = 0;
+
+	if ((f->family && rtm->rtm_family != f->family) ||
+	    (f->protocol && rtm->rtm_protocol != f->protocol))
+		return 0;
+
+	mnl_attr_for_each(attr, nlh, sizeof *rtm) {
+		switch (mnl_attr_get_type(attr)) {
+		case RTA_TABLE:
+			table = mnl_attr_get_u32(attr);
+			break;
+		case RTA_OIF:
+			oif = mnl_attr_get_u32(attr);
+			break;
+		}
+	}
+	return (!f->table || table == f->table) &&
+		(!f->index || oif == f->index);
+}
+
+/* Routes are filtered by the outgoing interface and the table */
+static void route_bpf(struct nlbpf *p, const struct event_filter *f)
+{
+	if (f->nindex) {
+		bpf_load_attr(p, sizeof(struct rtmsg), RTA_OIF);
+		bpf_in_set(p, 4, f->index, f->nindex);
+	}
+	if (f->ntable) {
+		bpf_load_attr(p, sizeof(struct rtmsg), RTA_TABLE);
+		bpf_in_set(p, 4, f->table, f->ntable);
+	}
+}
+
+/* Builds a unicast route of "dst" with the optional "gateway", "prefsrc",
+ * "index", "metric", "table", "protocol" and "scope", like "ip route"
+ */
+static const char *route_build(struct nlmsghdr *nlh, lua_State *L, int idx)
+{
+	struct rtmsg *rtm = mnl_nlmsg_get_payload(nlh);
+	int family = 0, len, gateway;
+	lua_Integer value;
+
+	if (write_addr(nlh, L, idx, "dst", RTA_DST, &family, &len) <= 0)
+		return "Invalid destination";
+	rtm->rtm_family = family;
+	rtm->rtm_dst_len = len;
+	gateway = write_addr(nlh, L, idx, "gateway", RTA_GATEWAY,
+				&family, &len);
+	if (gateway < 0)
+		return "Invalid gateway";
+	if (write_addr(nlh, L, idx, "prefsrc", RTA_PREFSRC, &family, &len) < 0)
+		return "Invalid prefsrc";
+
+	switch (write_integer(L, idx, "index", &value)) {
+	case -1:
+		return "Invalid index";
+	case 1:
+		if (value <= 0 || value > UINT32_MAX)
+			return "Invalid index";
+		mnl_attr_put_u32(nlh, RTA_OIF, value);
+	}
+	switch (write_integer(L, idx, "metric", &value)) {
+	case -1:
+		return "Invalid metric";
+	case 1:
+		if (value < 0 || value > UINT32_MAX)
+			return "Invalid metric";
+		mnl_attr_put_u32(nlh, RTA_PRIORITY, value);
+	}
+	value = RT_TABLE_MAIN;
+	if (write_integer(L, idx, "table", &value) < 0 ||
+	    value < 0 || value > UINT32_MAX)
+		return "Invalid table";
+	rtm->rtm_table = value < 256 ? value : RT_TABLE_UNSPEC;
+	mnl_attr_put_u32(nlh, RTA_TABLE, value);
+
+	rtm->rtm_type = RTN_UNICAST;
+	if (nlh->nlmsg_type == RTM_DELROUTE) {
+		rtm->rtm_scope = RT_SCOPE_NOWHERE;
+	} else {
+		rtm->rtm_protocol = RTPROT_STATIC;
+		rtm->rtm_scope = gateway ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+	}
+	value = rtm->rtm_protocol;
+	if (write_integer(L, idx, "protocol", &value) < 0 ||
+	    value < 0 || value > 255)
+		return "Invalid protocol";
+	rtm->rtm_protocol = value;
+	value = rtm->rtm_scope;
+	if (write_integer(L, idx, "scope", &value) < 0 ||
+	    value < 0 || value > 255)
+		return "Invalid scope";
+	rtm->rtm_scope = value;
+	return NULL;
+}
+
 struct rtmgrp route_rtmgrp = {
-	"route", RTMGRP_IPV4_ROUTE, route_cb,
-	RTM_NEWROUTE, RTM_DELROUTE, RTM_GETROUTE
+	"route", RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE, route_cb,
+	RTM_NEWROUTE, RTM_DELROUTE, RTM_GETROUTE,
+	sizeof(struct rtmsg),
+	NLA_BIT(RTA_DST) | NLA_BIT(RTA_SRC) | NLA_BIT(RTA_GATEWAY) |
+	NLA_BIT(RTA_PREFSRC) | NLA_BIT(RTA_OIF) | NLA_BIT(RTA_PRIORITY) |
+	NLA_BIT(RTA_TABLE),
+	route_key, route_lua_key,
+	7,
+	route_request, route_match,
+	route_bpf,
+	route_build
 };
 LUA_RTMGRP(route_rtmgrp);
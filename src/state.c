@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2021 Christian Hohnstaedt
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libmnl/libmnl.h>
+
+#include "netlink.h"
+
+/* cache_entry flag for deleted objects, kept for changes_since() */
+#define STATE_DELETED 1
+
+/* Copies the netlink message without volatile values like sequence
+ * numbers or statistics: Only the attributes in "rtmgrp->attrs" are kept.
+ * Returns the length of the copy or 0 if it does not fit into "buf".
+ */
+static size_t state_copy(const struct rtmgrp *rtmgrp,
+			const struct nlmsghdr *nlh, char *buf, size_t bufsize)
+{
+	size_t len = MNL_NLMSG_HDRLEN + MNL_ALIGN(rtmgrp->hdrlen);
+	struct nlmsghdr *copy = (struct nlmsghdr *)buf;
+	const struct nlattr *attr;
+
+	if (nlh->nlmsg_len < len || len > bufsize)
+		return 0;
+
+	memcpy(buf, nlh, len);
+	copy->nlmsg_len = len;
+	copy->nlmsg_flags = 0;
+	copy->nlmsg_seq = 0;
+	copy->nlmsg_pid = 0;
+
+	mnl_attr_for_each(attr, nlh, rtmgrp->hdrlen) {
+		int type = mnl_attr_get_type(attr);
+		size_t alen = mnl_attr_get_len(attr);
+
+		if (type >= 64 || !(rtmgrp->attrs & NLA_BIT(type)))
+			continue;
+		if (copy->nlmsg_len + MNL_ALIGN(alen) > bufsize)
+			return 0;
+		memcpy(buf + copy->nlmsg_len, attr, alen);
+		memset(buf + copy->nlmsg_len + alen, 0, MNL_ALIGN(alen) - alen);
+		copy->nlmsg_len += MNL_ALIGN(alen);
+	}
+	return copy->nlmsg_len;
+}
+
+/* The key is prefixed by the "new" message type of the group */
+static size_t state_key(const struct rtmgrp *rtmgrp, struct nlmsghdr *copy,
+			unsigned char *key)
+{
+	uint16_t type = rtmgrp->new;
+	size_t len = rtmgrp->key(copy, key + sizeof type);
+
+	if (!len)
+		return 0;
+	memcpy(key, &type, sizeof type);
+	return len + sizeof type;
+}
+
+static const struct rtmgrp *state_group(const struct cache_entry *e)
+{
+	uint16_t type;
+
+	memcpy(&type, e->data, sizeof type);
+	return rtmgrp_by_type(type);
+}
+
+/* Marks the entry as deleted. The entry itself is removed, if no
+ * changes_since() consumer needs to see it. See state_limit().
+ */
+static void state_delete(struct userdata *userdata, struct cache_entry *e,
+			const struct rtmgrp *rtmgrp)
+{
+	struct nlmsghdr *nlh = cache_value(e);
+
+	if (!userdata->keep_deleted) {
+		cache_del(userdata->state, e);
+		return;
+	}
+	nlh->nlmsg_type = rtmgrp->del;
+	e->flags |= STATE_DELETED;
+	e->version = ++userdata->version;
+	userdata->deleted++;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+
+	return va < vb ? -1 : va > vb;
+}
+
+/* Drops the oldest deleted objects, if more than "max_deleted" are kept.
+ * Half of the limit is kept, so the scan runs once per "max_deleted" / 2
+ * deletions. Without memory for sorting, all of them are dropped.
+ * Must not be called while iterating over the state.
+ */
+static void state_limit(struct userdata *userdata)
+{
+	size_t keep = userdata->max_deleted / 2, n = 0;
+	uint64_t *versions, limit = userdata->version;
+	struct cache_entry *e, *next;
+
+	if (userdata->deleted <= userdata->max_deleted)
+		return;
+
+	versions = malloc(userdata->deleted * sizeof *versions);
+	if (versions) {
+		for (e = cache_next(userdata->state, NULL); e;
+		     e = cache_next(userdata->state, e))
+		{
+			if (e->flags & STATE_DELETED && n < userdata->deleted)
+				versions[n++] = e->version;
+		}
+		qsort(versions, n, sizeof *versions, u64_cmp);
+		limit = n > keep ? versions[n - keep - 1] : 0;
+		free(versions);
+	}
+
+	for (e = cache_next(userdata->state, NULL); e; e = next) {
+		next = cache_next(userdata->state, e);
+		if (e->flags & STATE_DELETED && e->version <= limit) {
+			cache_del(userdata->state, e);
+			userdata->deleted--;
+		}
+	}
+	if (limit > userdata->dropped)
+		userdata->dropped = limit;
+}
+
+/* Updates the state copy by a "new" or "del" message.
+ * Returns 0 if the message is a reply of the running "resync" dump
+ * and nothing changed. The event is suppressed in this case.
+ */
+int state_update(struct userdata *userdata, const struct rtmgrp *rtmgrp,
+			const struct nlmsghdr *nlh)
+{
+	char buf[NL_RECV_BUFSIZE];
+	unsigned char key[NL_KEY_MAX];
+	struct nlmsghdr *copy = (struct nlmsghdr *)buf;
+	struct cache_entry *e;
+	size_t len, keylen;
+
+	if (!rtmgrp->key || !userdata->state)
+		return 1;
+
+	len = state_copy(rtmgrp, nlh, buf, sizeof buf);
+	if (!len)
+		return 1;
+	keylen = state_key(rtmgrp, copy, key);
+	if (!keylen)
+		return 1;
+
+	e = cache_get(userdata->state, key, keylen);
+	if (nlh->nlmsg_type == rtmgrp->del) {
+		if (e && !(e->flags & STATE_DELETED)) {
+			state_delete(userdata, e, rtmgrp);
+			state_limit(userdata);
+		}
+		return 1;
+	}
+	if (e && !(e->flags & STATE_DELETED) &&
+	    e->len == len && !memcmp(cache_value(e), copy, len))
+	{
+		/* Unchanged: Suppress the event of a resync dump */
+		e->mark = userdata->mark;
+		return userdata->resyncing != rtmgrp;
+	}
+	/* A deleted object is back */
+	if (e && e->flags & STATE_DELETED)
+		userdata->deleted--;
+	e = cache_put(userdata->state, key, keylen, copy, len);
+	if (!e)
+		return luaL_error(userdata->L, "Out of memory for state");
+	e->flags = 0;
+	e->mark = userdata->mark;
+	e->version = ++userdata->version;
+	return 1;
+}
+
+/* Returns 1 if the object of the message is in the state copy,
+ * 0 if not and -1 without state copy
+ */
+int state_has(struct userdata *userdata, const struct rtmgrp *rtmgrp,
+			const struct nlmsghdr *nlh)
+{
+	char buf[NL_RECV_BUFSIZE];
+	unsigned char key[NL_KEY_MAX];
+	struct cache_entry *e;
+	size_t keylen;
+
+	if (!rtmgrp->key || !userdata->state)
+		return -1;
+	if (!state_copy(rtmgrp, nlh, buf, sizeof buf))
+		return -1;
+	keylen = state_key(rtmgrp, (struct nlmsghdr *)buf, key);
+	if (!keylen)
+		return -1;
+	e = cache_get(userdata->state, key, keylen);
+	return e && !(e->flags & STATE_DELETED);
+}
+
+/* Emits "del" events for all objects of the group,
+ * which were not seen during the last dump
+ */
+static void state_sweep(struct userdata *userdata, const struct rtmgrp *rtmgrp)
+{
+	struct cache_entry *e, *next;
+
+	for (e = cache_next(userdata->state, NULL); e; e = next) {
+		struct nlmsghdr *nlh = cache_value(e);
+
+		next = cache_next(userdata->state, e);
+		if (e->mark == userdata->mark || e->flags & STATE_DELETED ||
+		    state_group(e) != rtmgrp)
+			continue;
+
+		nlh->nlmsg_type = rtmgrp->del;
+		index_update(userdata, nlh);
+		emit_message(userdata, rtmgrp, nlh);
+		state_delete(userdata, e, rtmgrp);
+	}
+}
+
+/* Re-dumps all subscribed groups after a socket overflow and emits
+ * events only for objects that changed compared to the state copy.
+ */
+void state_resync(struct userdata *userdata, lua_State *L)
+{
+	int tries;
+
+	for (tries = 0; userdata->resync_pending && tries < 3; tries++) {
+		struct rtmgrp *rtmgrp;
+
+		userdata->resync_pending = 0;
+		for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp; rtmgrp++) {
+			if (!(userdata->groups & rtmgrp->group) || !rtmgrp->key)
+				continue;
+
+			userdata->mark++;
+			userdata->resyncing = rtmgrp;
+			dump_parallel(userdata, L, rtmgrp->group);
+			userdata->resyncing = NULL;
+			state_sweep(userdata, rtmgrp);
+			state_limit(userdata);
+		}
+	}
+}
+
+static struct userdata *get_state(lua_State *L)
+{
+	struct userdata *userdata = get_userdata(L);
+
+	if (!userdata->state)
+		luaL_error(L, "State tracking is not enabled for this socket");
+	return userdata;
+}
+
+/* Returns an array of all known objects of all groups or of the
+ * group given as argument and the current state version
+ */
+int nlfunc_snapshot(lua_State *L)
+{
+	struct userdata *userdata = get_state(L);
+	const struct rtmgrp *rtmgrp = NULL;
+	struct cache_entry *e;
+
+	check_idle(userdata, L);
+	reset_call(userdata, L);
+	if (!lua_isnoneornil(L, 2))
+		rtmgrp = rtmgrp_by_name(L, 2);
+
+	push_result(userdata, L);
+
+	for (e = cache_next(userdata->state, NULL); e;
+	     e = cache_next(userdata->state, e))
+	{
+		const struct rtmgrp *group = state_group(e);
+
+		if (e->flags & STATE_DELETED || (rtmgrp && rtmgrp != group))
+			continue;
+		emit_message(userdata, group, cache_value(e));
+	}
+	lua_pushinteger(L, userdata->version);
+	return 2;
+}
+
+/* Returns a single object of the group, e.g.
+ * get("link", 2), get("ifaddr", 2, "192.168.1.3/24"),
+ * get("route", "10.0.0.0/8", table, metric), get("neigh", 2, "192.168.1.1")
+ */
+int nlfunc_get(lua_State *L)
+{
+	struct userdata *userdata = get_state(L);
+	const struct rtmgrp *rtmgrp = rtmgrp_by_name(L, 2);
+	unsigned char key[NL_KEY_MAX];
+	uint16_t type = rtmgrp->new;
+	const uint32_t *projection = userdata->projection;
+	const struct dump_filter *filter = userdata->filter;
+	lua_Integer query = userdata->query;
+	lua_State *prev = userdata->L;
+	int nsid = userdata->nsid, ret;
+	struct cache_entry *e;
+	size_t keylen;
+
+	if (!rtmgrp->lua_key)
+		return luaL_error(L, "No lookup for group '%s'", rtmgrp->name);
+
+	keylen = rtmgrp->lua_key(L, 3, key + sizeof type);
+	memcpy(key, &type, sizeof type);
+
+	e = cache_get(userdata->state, key, keylen + sizeof type);
+	if (!e || e->flags & STATE_DELETED) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	/* A handler may call it: Restore the state of the running call */
+	reset_call(userdata, L);
+	ret = push_message(userdata, rtmgrp, cache_value(e));
+	userdata->projection = projection;
+	userdata->filter = filter;
+	userdata->query = query;
+	userdata->nsid = nsid;
+	userdata->L = prev;
+	if (!ret)
+		lua_pushnil(L);
+	return 1;
+}
+
+static int version_cmp(const void *a, const void *b)
+{
+	const struct cache_entry *ea = *(struct cache_entry * const *)a;
+	const struct cache_entry *eb = *(struct cache_entry * const *)b;
+
+	return ea->version < eb->version ? -1 : ea->version > eb->version;
+}
+
+/* Returns an array of all objects changed after "version" in the order
+ * of their modification and the current version.
+ * Deleted objects are reported as "del..." events, up to the limit of
+ * the "tombstones" option. The third value is true, if deleted objects
+ * newer than "version" were dropped by the limit: The caller missed
+ * deletions and has to start over with snapshot().
+ */
+int nlfunc_changes_since(lua_State *L)
+{
+	struct userdata *userdata = get_state(L);
+	uint64_t version = luaL_checkinteger(L, 2);
+	struct cache_entry *e, **changes;
+	size_t i, n = 0;
+
+	check_idle(userdata, L);
+	reset_call(userdata, L);
+	push_result(userdata, L);
+
+	changes = lua_newuserdata(L, (userdata->state->count + 1) *
+					sizeof *changes);
+	for (e = cache_next(userdata->state, NULL); e;
+	     e = cache_next(userdata->state, e))
+	{
+		if (e->version > version)
+			changes[n++] = e;
+	}
+	qsort(changes, n, sizeof *changes, version_cmp);
+
+	for (i = 0; i < n; i++)
+		emit_message(userdata, state_group(changes[i]),
+				cache_value(changes[i]));
+
+	lua_pop(L, 1);
+	lua_pushinteger(L, userdata->version);
+	lua_pushboolean(L, version < userdata->dropped);
+	return 3;
+}
+
+/* Returns the current version of the state */
+int nlfunc_version(lua_State *L)
+{
+	struct userdata *userdata = get_state(L);
+	lua_pushinteger(L, userdata->version);
+	return 1;
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2021 Christian Hohnstaedt
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <libmnl/libmnl.h>
+#include <linux/if_link.h>
+#include <linux/rtnetlink.h>
+
+#include "netlink.h"
+
+/* Link statistics by RTM_GETSTATS. The previous sample of every
+ * interface is kept to return the deltas and rates per second.
+ */
+
+static const struct {
+	const char *name;
+	size_t offset;
+} stats_counters[] = {
+	{ "rx_bytes", offsetof(struct rtnl_link_stats64, rx_bytes) },
+	{ "tx_bytes", offsetof(struct rtnl_link_stats64, tx_bytes) },
+	{ "rx_packets", offsetof(struct rtnl_link_stats64, rx_packets) },
+	{ "tx_packets", offsetof(struct rtnl_link_stats64, tx_packets) },
+	{ "rx_errors", offsetof(struct rtnl_link_stats64, rx_errors) },
+	{ "tx_errors", offsetof(struct rtnl_link_stats64, tx_errors) },
+	{ "rx_dropped", offsetof(struct rtnl_link_stats64, rx_dropped) },
+	{ "tx_dropped", offsetof(struct rtnl_link_stats64, tx_dropped) },
+};
+
+#define STATS_COUNTERS (sizeof stats_counters / sizeof *stats_counters)
+
+struct stats_sample {
+	lua_Integer stamp;
+	uint64_t counter[STATS_COUNTERS];
+};
+
+static int stats_request(struct mnl_socket *nl, uint32_t index,
+			unsigned int seq)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	struct if_stats_msg *ifsm;
+
+	nlh->nlmsg_type = RTM_GETSTATS;
+	nlh->nlmsg_flags = NLM_F_REQUEST | (index ? 0 : NLM_F_DUMP);
+	nlh->nlmsg_seq = seq;
+	ifsm = mnl_nlmsg_put_extra_header(nlh, sizeof *ifsm);
+	ifsm->family = AF_UNSPEC;
+	ifsm->ifindex = index;
+	ifsm->filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+
+	return mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0 ? -1 : 0;
+}
+
+static void push_counters(lua_State *L, const char *which,
+			const uint64_t *counter)
+{
+	size_t i;
+
+	lua_createtable(L, 0, STATS_COUNTERS);
+	for (i = 0; i < STATS_COUNTERS; i++) {
+		lua_pushinteger(L, counter[i]);
+		lua_setfield(L, -2, stats_counters[i].name);
+	}
+	lua_setfield(L, -2, which);
+}
+
+/* Appends the entry of a RTM_NEWSTATS message to the result array
+ * and stores the sample
+ */
+static void stats_entry(struct userdata *userdata, lua_State *L,
+			const struct nlmsghdr *nlh, lua_Integer stamp)
+{
+	const struct if_stats_msg *ifsm = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr, *stats64 = NULL;
+	struct stats_sample sample, prev;
+	struct cache_entry *e;
+	uint64_t delta[STATS_COUNTERS];
+	uint32_t index = ifsm->ifindex;
+	double secs;
+	size_t i;
+
+	mnl_attr_for_each(attr, nlh, sizeof *ifsm) {
+		if (mnl_attr_get_type(attr) == IFLA_STATS_LINK_64 &&
+		    mnl_attr_get_payload_len(attr) >=
+				sizeof(struct rtnl_link_stats64))
+			stats64 = attr;
+	}
+	if (!stats64)
+		return;
+
+	sample.stamp = stamp;
+	for (i = 0; i < STATS_COUNTERS; i++)
+		memcpy(&sample.counter[i], (char *)mnl_attr_get_payload(stats64) +
+			stats_counters[i].offset, sizeof sample.counter[i]);
+
+	lua_createtable(L, 0, 5);
+	set_integer(L, "index", index);
+	set_integer(L, "stamp", stamp);
+	push_counters(L, "counters", sample.counter);
+
+	e = cache_get(&userdata->stats, &index, sizeof index);
+	if (e) {
+		memcpy(&prev, cache_value(e), sizeof prev);
+		/* A counter below the previous one was reset */
+		for (i = 0; i < STATS_COUNTERS; i++)
+			delta[i] = sample.counter[i] >= prev.counter[i] ?
+				sample.counter[i] - prev.counter[i] :
+				sample.counter[i];
+		push_counters(L, "delta", delta);
+
+		secs = (stamp - prev.stamp) / 1000.0;
+		if (secs > 0) {
+			lua_createtable(L, 0, STATS_COUNTERS);
+			for (i = 0; i < STATS_COUNTERS; i++) {
+				lua_pushnumber(L, delta[i] / secs);
+				lua_setfield(L, -2, stats_counters[i].name);
+			}
+			lua_setfield(L, -2, "rate");
+		}
+	}
+	lua_rawseti(L, userdata->result, ++userdata->nresults);
+
+	e = cache_put(&userdata->stats, &index, sizeof index,
+			&sample, sizeof sample);
+	if (!e)
+		luaL_error(L, "Out of memory for statistics");
+	e->mark = userdata->stats_mark;
+}
+
+/* Receives the replies of the last request until the dump is done */
+static void stats_receive(struct userdata *userdata, lua_State *L,
+			struct mnl_socket *nl, unsigned int seq)
+{
+	char buf[MNL_SOCKET_DUMP_SIZE];
+	struct pollfd pfd = {
+		.fd = mnl_socket_get_fd(nl),
+		.events = POLLIN,
+	};
+	unsigned int portid = mnl_socket_get_portid(nl);
+	lua_Integer stamp = timestamp();
+
+	for (;;) {
+		const struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+		int len, ret = poll(&pfd, 1, userdata->dump_timeout);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			luaL_error(L, "poll(): %s", strerror(errno));
+		if (ret == 0)
+			luaL_error(L, "Timeout while dumping statistics");
+
+		len = mnl_socket_recvfrom(nl, buf, sizeof buf);
+		if (len < 0)
+			luaL_error(L, "mnl_socket_recvfrom(): %s",
+					strerror(errno));
+
+		for (; mnl_nlmsg_ok(nlh, len); nlh = mnl_nlmsg_next(nlh, &len)) {
+			if (!mnl_nlmsg_portid_ok(nlh, portid) ||
+			    !mnl_nlmsg_seq_ok(nlh, seq))
+				continue;
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				const struct nlmsgerr *err =
+					mnl_nlmsg_get_payload(nlh);
+				if (err->error)
+					luaL_error(L, "RTM_GETSTATS: %s",
+						strerror(-err->error));
+				return;
+			}
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return;
+			if (nlh->nlmsg_type != RTM_NEWSTATS)
+				continue;
+			stats_entry(userdata, L, nlh, stamp);
+			if (!(nlh->nlmsg_flags & NLM_F_MULTI))
+				return;
+		}
+	}
+}
+
+/* Returns an array with the counters of all links or of the interface
+ * index given as argument. Each entry has the "index", the "stamp" and
+ * the "counters". The "delta" since the previous call and the "rate"
+ * per second are added if a previous sample of the interface exists.
+ */
+int nlfunc_stats(lua_State *L)
+{
+	struct userdata *userdata = get_userdata(L);
+	uint32_t index = luaL_optinteger(L, 2, 0);
+	struct cache_entry *e, *next;
+
+	check_idle(userdata, L);
+	if (!userdata->stats_nl)
+		userdata->stats_nl = dump_socket(userdata, L);
+
+	push_result(userdata, L);
+	userdata->stats_mark++;
+
+	if (stats_request(userdata->stats_nl, index, ++userdata->stats_seq) < 0)
+		return luaL_error(L, "mnl_socket_sendto(): %s",
+					strerror(errno));
+	stats_receive(userdata, L, userdata->stats_nl, userdata->stats_seq);
+
+	/* Forget the samples of removed interfaces */
+	if (!index) {
+		for (e = cache_next(&userdata->stats, NULL); e; e = next) {
+			next = cache_next(&userdata->stats, e);
+			if (e->mark != userdata->stats_mark)
+				cache_del(&userdata->stats, e);
+		}
+	}
+	return 1;
+}
@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2021 Christian Hohnstaedt
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE /* recvmmsg() */
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <libmnl/libmnl.h>
+#include <linux/netlink.h>
+
+#include "netlink.h"
+
+/* Added in Linux 4.12 */
+#ifndef NLM_F_ACK_TLVS
+#define NLM_F_CAPPED 0x100
+#define NLM_F_ACK_TLVS 0x200
+#define NLMSGERR_ATTR_MSG 1
+#endif
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK 10
+#endif
+#ifndef NETLINK_EXT_ACK
+#define NETLINK_EXT_ACK 11
+#endif
+
+/* Requests of write() are packed into batches of up to NL_BATCH_MAX
+ * messages and NL_BATCH_SIZE bytes, each sent by one sendmsg(). The kernel
+ * processes a batch within the call, so all its acknowledgements are
+ * queued when it returns. They are read before the next batch is sent,
+ * to fit into the socket receive buffer.
+ */
+#define NL_BATCH_MAX 128
+#define NL_BATCH_SIZE 65536
+#define NL_ACK_SIZE 1024
+
+struct write_batch {
+	struct mnl_nlmsg_batch *batch;
+	struct mmsghdr msgs[NL_BATCH_MAX];
+	struct iovec iov[NL_BATCH_MAX];
+	char acks[NL_BATCH_MAX][NL_ACK_SIZE];
+	/* Twice the limit, the message exceeding it is moved to the next */
+	char buf[2 * NL_BATCH_SIZE];
+};
+
+/* Appends the IP address of the string "which" of the table at "idx" as
+ * attribute "type". Its family must match "family", if that is set.
+ * Returns 1 if it was appended, 0 if it is missing and -1 if it is invalid.
+ */
+int write_addr(struct nlmsghdr *nlh, lua_State *L, int idx,
+		const char *which, int type, int *family, int *prefixlen)
+{
+	uint8_t addr[16];
+	const char *str;
+	int f, ret = 0;
+
+	lua_getfield(L, idx, which);
+	str = lua_tostring(L, -1);
+	if (str) {
+		ret = -1;
+		if (parse_addr(str, &f, addr, prefixlen) == 0 &&
+		    (!*family || *family == f)) {
+			*family = f;
+			mnl_attr_put(nlh, type, f == AF_INET ? 4 : 16, addr);
+			ret = 1;
+		}
+	}
+	lua_pop(L, 1);
+	return ret;
+}
+
+/* Reads the integer "which" of the table at "idx".
+ * Returns 1 if it was read, 0 if it is missing and -1 if it is invalid.
+ */
+int write_integer(lua_State *L, int idx, const char *which,
+		lua_Integer *value)
+{
+	int ret = 0;
+
+	lua_getfield(L, idx, which);
+	if (!lua_isnil(L, -1)) {
+		ret = lua_isinteger(L, -1) ? 1 : -1;
+		if (ret > 0)
+			*value = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	return ret;
+}
+
+/* Returns the socket of write(), opens it in the namespace of the socket.
+ * Acknowledgements carry the extended error message, but not the request.
+ */
+static struct mnl_socket *write_socket(struct userdata *userdata,
+			lua_State *L)
+{
+	int one = 1, size = 2 * NL_BATCH_MAX * NL_ACK_SIZE;
+
+	if (userdata->write_nl)
+		return userdata->write_nl;
+	userdata->write_nl = dump_socket(userdata, L);
+	mnl_socket_setsockopt(userdata->write_nl, NETLINK_CAP_ACK,
+				&one, sizeof one);
+	mnl_socket_setsockopt(userdata->write_nl, NETLINK_EXT_ACK,
+				&one, sizeof one);
+	setsockopt(mnl_socket_get_fd(userdata->write_nl), SOL_SOCKET,
+				SO_RCVBUF, &size, sizeof size);
+	return userdata->write_nl;
+}
+
+/* Builds the request of the table at "idx" into "nlh":
+ * { op = "add", group = "route", dst = "10.0.0.0/8", ... }
+ * Returns NULL or the message, why it is invalid.
+ */
+static const char *write_request(lua_State *L, int idx, struct nlmsghdr *nlh)
+{
+	const struct rtmgrp *rtmgrp;
+	const char *op, *group;
+
+	if (!lua_istable(L, idx))
+		return "Invalid request";
+	lua_getfield(L, idx, "op");
+	lua_getfield(L, idx, "group");
+	op = lua_tostring(L, -2);
+	group = lua_tostring(L, -1);
+	lua_pop(L, 2);
+	if (!op || !group)
+		return "Invalid request";
+
+	for (rtmgrp = &__start_rtmgrp; rtmgrp < &__stop_rtmgrp; rtmgrp++) {
+		if (!strcmp(group, rtmgrp->name))
+			break;
+	}
+	if (rtmgrp == &__stop_rtmgrp || !rtmgrp->build)
+		return "Unsupported group";
+
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	if (!strcmp(op, "add")) {
+		nlh->nlmsg_type = rtmgrp->new;
+		nlh->nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+	} else if (!strcmp(op, "replace")) {
+		nlh->nlmsg_type = rtmgrp->new;
+		nlh->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+	} else if (!strcmp(op, "del")) {
+		nlh->nlmsg_type = rtmgrp->del;
+	} else {
+		return "Invalid operation";
+	}
+	mnl_nlmsg_put_extra_header(nlh, rtmgrp->hdrlen);
+	return rtmgrp->build(nlh, L, idx);
+}
+
+/* Pushes the error of the acknowledgement with the extended message */
+static void push_ack_error(lua_State *L, const struct nlmsghdr *nlh)
+{
+	const struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr;
+	const char *msg = NULL;
+	size_t offset = sizeof *err;
+
+	if (nlh->nlmsg_flags & NLM_F_ACK_TLVS) {
+		if (!(nlh->nlmsg_flags & NLM_F_CAPPED))
+			offset += err->msg.nlmsg_len - sizeof err->msg;
+		mnl_attr_for_each(attr, nlh, offset) {
+			if (mnl_attr_get_type(attr) == NLMSGERR_ATTR_MSG &&
+			    mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) == 0)
+				msg = mnl_attr_get_str(attr);
+		}
+	}
+	if (msg)
+		lua_pushfstring(L, "%s: %s", strerror(-err->error), msg);
+	else
+		lua_pushstring(L, strerror(-err->error));
+}
+
+/* Receives the acknowledgements of the "pending" requests sent and sets
+ * the results: Request "i" has the sequence number "base" + "i".
+ */
+static void write_acks(struct userdata *userdata, lua_State *L,
+			struct write_batch *w, unsigned int base,
+			lua_Integer n, int pending, lua_Integer *failed)
+{
+	struct mnl_socket *nl = userdata->write_nl;
+	unsigned int portid = mnl_socket_get_portid(nl);
+	lua_Integer deadline = timestamp() + userdata->dump_timeout;
+	struct pollfd pfd = {
+		.fd = mnl_socket_get_fd(nl),
+		.events = POLLIN,
+	};
+
+	while (pending > 0) {
+		lua_Integer timeout = deadline - timestamp();
+		int ret, i;
+
+		if (timeout <= 0)
+			luaL_error(L, "Timeout while waiting for acknowledgements");
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0 && errno != EINTR)
+			luaL_error(L, "poll(): %s", strerror(errno));
+		if (ret <= 0)
+			continue;
+
+		for (i = 0; i < pending; i++)
+			w->msgs[i].msg_hdr.msg_flags = 0;
+		ret = recvmmsg(pfd.fd, w->msgs, pending, MSG_WAITFORONE, NULL);
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (ret < 0)
+			luaL_error(L, "recvmmsg(): %s", errno == ENOBUFS ?
+				"Acknowledgements lost" : strerror(errno));
+
+		for (i = 0; i < ret; i++) {
+			const struct nlmsghdr *nlh = (struct nlmsghdr *)w->acks[i];
+			int len = w->msgs[i].msg_len;
+
+			for (; mnl_nlmsg_ok(nlh, len);
+			     nlh = mnl_nlmsg_next(nlh, &len)) {
+				const struct nlmsgerr *err;
+				unsigned int idx = nlh->nlmsg_seq - base;
+
+				if (nlh->nlmsg_type != NLMSG_ERROR ||
+				    !mnl_nlmsg_portid_ok(nlh, portid) ||
+				    idx < 1 || idx > n)
+					continue;
+				err = mnl_nlmsg_get_payload(nlh);
+				if (err->error) {
+					push_ack_error(L, nlh);
+					(*failed)++;
+				} else {
+					lua_pushboolean(L, 1);
+				}
+				lua_rawseti(L, 3, idx);
+				pending--;
+			}
+		}
+	}
+}
+
+/* Sends the batch and waits for its acknowledgements */
+static void write_flush(struct userdata *userdata, lua_State *L,
+			struct write_batch *w, unsigned int base,
+			lua_Integer n, int pending, lua_Integer *failed)
+{
+	if (mnl_socket_sendto(userdata->write_nl,
+			mnl_nlmsg_batch_head(w->batch),
+			mnl_nlmsg_batch_size(w->batch)) < 0)
+		luaL_error(L, "mnl_socket_sendto(): %s", strerror(errno));
+	write_acks(userdata, L, w, base, n, pending, failed);
+	mnl_nlmsg_batch_reset(w->batch);
+}
+
+static int write_batch_gc(lua_State *L)
+{
+	struct write_batch *w = lua_touserdata(L, 1);
+
+	if (w->batch)
+		mnl_nlmsg_batch_stop(w->batch);
+	w->batch = NULL;
+	return 0;
+}
+
+/* Adds, replaces or deletes routes, addresses and neighbours.
+ * The argument is an array of requests, each a table with the operation
+ * "op" ("add", "replace" or "del"), the "group" and the fields of
+ * the object, see the "build" functions of the groups.
+ * Returns an array with true or the error message for each request and
+ * the number of failed requests.
+ */
+int nlfunc_write(lua_State *L)
+{
+	struct userdata *userdata = get_userdata(L);
+	struct write_batch *w;
+	lua_Integer i, n, failed = 0;
+	unsigned int base;
+	int j, pending = 0;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = luaL_len(L, 2);
+	lua_settop(L, 2);
+	write_socket(userdata, L);
+	lua_createtable(L, n, 0);                    /* 3 */
+
+	w = lua_newuserdata(L, sizeof *w);          /* 4 */
+	w->batch = NULL;
+	luaL_setmetatable(L, "mnl.write_batch");
+	for (j = 0; j < NL_BATCH_MAX; j++) {
+		struct msghdr *hdr = &w->msgs[j].msg_hdr;
+
+		memset(hdr, 0, sizeof *hdr);
+		w->iov[j].iov_base = w->acks[j];
+		w->iov[j].iov_len = NL_ACK_SIZE;
+		hdr->msg_iov = &w->iov[j];
+		hdr->msg_iovlen = 1;
+	}
+	w->batch = mnl_nlmsg_batch_start(w->buf, NL_BATCH_SIZE);
+	if (!w->batch)
+		return luaL_error(L, "mnl_nlmsg_batch_start(): %s",
+					strerror(errno));
+
+	base = userdata->write_seq;
+	userdata->write_seq += n;
+	for (i = 1; i <= n; i++) {
+		struct nlmsghdr *nlh;
+		const char *err;
+
+		lua_rawgeti(L, 2, i);
+		nlh = mnl_nlmsg_put_header(mnl_nlmsg_batch_current(w->batch));
+		err = write_request(L, lua_gettop(L), nlh);
+		lua_pop(L, 1);
+		if (err) {
+			lua_pushstring(L, err);
+			lua_rawseti(L, 3, i);
+			failed++;
+			continue;
+		}
+		nlh->nlmsg_seq = base + i;
+		pending++;
+
+		/* The message exceeding the limit goes into the next batch */
+		if (!mnl_nlmsg_batch_next(w->batch)) {
+			write_flush(userdata, L, w, base, n, pending - 1,
+					&failed);
+			pending = 1;
+		} else if (pending == NL_BATCH_MAX) {
+			write_flush(userdata, L, w, base, n, pending, &failed);
+			pending = 0;
+		}
+	}
+	if (pending)
+		write_flush(userdata, L, w, base, n, pending, &failed);
+
+	lua_settop(L, 3);
+	lua_pushinteger(L, failed);
+	return 2;
+}
+
+/* Registers the metatable of the batch buffer */
+void write_init(lua_State *L)
+{
+	if (luaL_newmetatable(L, "mnl.write_batch")) {
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, write_batch_gc);
+		lua_rawset(L, -3);
+	}
+	lua_pop(L, 1);
+}